@@ -1,4 +1,7 @@
 #pragma once
+#include<algorithm> // std::binary_search, std::lower_bound
+#include<cstring> // std::memcpy
+#include<limits> // std::numeric_limits
 #include<new> // std::launder
 #include<tuple>
 #include<utility>
@@ -992,6 +995,156 @@ Size size(HoleyArray<El, Size> const &arr) {
 	return arr.capacity - arr.holeIs.size();
 }
 
+// like HoleyArray, but which elements are filled is kept in a bitmap, and the
+// holes are linked into a free list through their own buckets, so emplace and
+// destroy are O(1), and iterating skips a word's worth of holes at a time
+template<typename El, typename Size_>
+struct BitmapHoleyArray {
+	static_assert(!std::is_const_v<El>);
+	typedef Size_ Size;
+	typedef FastInteger<Size> FastSize;
+	static Size constexpr bucketSize= std::max(sizeof(Size), sizeof(El));
+	static Size constexpr noFreeI= std::numeric_limits<Size>::max();
+	char *mem{nullptr};
+	Size capacity;
+	Size filledC= 0;
+	// bit i%64 of word i/64 is set if element i is filled
+	std::vector<U64> occupancy;
+	// the hole to be filled next, whose bucket holds the index of the one after
+	Size freeHeadI;
+	BitmapHoleyArray(BitmapHoleyArray const&)= delete;
+	BitmapHoleyArray(Size const initialCap);
+	~BitmapHoleyArray();
+	template<typename Index, typename= EnableIfIntegral<Index>>
+	El &operator[](Index);
+	template<typename Index, typename= EnableIfIntegral<Index>>
+	El const &operator[](Index) const;
+};
+
+// links the holes from $beginI up to $endI into the front of the free list, lowest first
+template<typename El, typename Size>
+void linkBitmapHoleyArrayHoles(BitmapHoleyArray<El, Size> &arr, Size const beginI, Size const endI) {
+	for(FastInteger<Size> i=endI; beginI < i--;) {
+		std::memcpy(arr.mem + arr.bucketSize*i, &arr.freeHeadI, sizeof arr.freeHeadI);
+		arr.freeHeadI= i;
+	}
+}
+
+template<typename El, typename Size>
+BitmapHoleyArray<El, Size>::BitmapHoleyArray(Size const initialCap):
+	mem{allocAlignedMemory(
+		std::max(alignof(Size), alignof(El)),
+		bucketSize,
+		initialCap
+	)},
+	capacity{initialCap},
+	occupancy((initialCap + 63) / 64),
+	freeHeadI{noFreeI}
+{
+	linkBitmapHoleyArrayHoles(*this, Size{0}, initialCap);
+}
+
+template<typename El, typename Size, typename Index>
+void destroy(BitmapHoleyArray<El, Size> &arr, Index const i) {
+	arr[i].~El();
+	arr.occupancy[i / 64]&= ~(U64{1} << i % 64);
+	--arr.filledC;
+	std::memcpy(arr.mem + arr.bucketSize*i, &arr.freeHeadI, sizeof arr.freeHeadI);
+	arr.freeHeadI= i;
+}
+
+// passes the index at which the element will be created to $create
+// $create should call the callback passed to it with the arguments the caller wants forwarded to El's ctor
+// returns whatever $create returns
+template<typename El, typename Size, typename CreateFunc>
+decltype(auto) emplace(BitmapHoleyArray<El, Size> &arr, CreateFunc &&create) {
+	if(arr.freeHeadI == arr.noFreeI) {
+		// it's full, so every bucket holds an element
+		static_assert(std::is_nothrow_constructible_v<El, El&&>);
+		FastInteger<Size> const newCapacity= arr.capacity + std::max<FastInteger<Size>>(arr.capacity / 2, 1);
+		ASSERT(newCapacity < arr.noFreeI);
+		char *const newMem= allocAlignedMemory(
+			std::max(alignof(Size), alignof(El)),
+			arr.bucketSize,
+			newCapacity
+		);
+		for(FastInteger<Size> i=0; i<arr.capacity; ++i) {
+			El &old= arr[i];
+			new(newMem + arr.bucketSize*i) El{std::move(old)};
+			old.~El();
+		}
+		delete[] arr.mem;
+		arr.mem= newMem;
+		arr.occupancy.resize((newCapacity + 63) / 64);
+		linkBitmapHoleyArrayHoles(arr, arr.capacity, static_cast<Size>(newCapacity));
+		arr.capacity= newCapacity;
+	}
+	Size const holeI= arr.freeHeadI;
+	std::memcpy(&arr.freeHeadI, arr.mem + arr.bucketSize*holeI, sizeof arr.freeHeadI);
+	arr.occupancy[holeI / 64]|= U64{1} << holeI % 64;
+	++arr.filledC;
+	ScopeFailGuard guard{[&arr, holeI]{
+		// the element wasn't created, so the hole goes back
+		arr.occupancy[holeI / 64]&= ~(U64{1} << holeI % 64);
+		--arr.filledC;
+		std::memcpy(arr.mem + arr.bucketSize*holeI, &arr.freeHeadI, sizeof arr.freeHeadI);
+		arr.freeHeadI= holeI;
+	}};
+	return create(
+		ConstructObjectWithGeneratedArgs<El>{arr.mem + arr.bucketSize*holeI},
+		holeI
+	);
+}
+
+template<typename El, typename Size>
+template<typename I, typename>
+El &BitmapHoleyArray<El, Size>::operator[](I const i) {
+	return *getElementPointer<El>(mem, i, bucketSize);
+}
+template<typename El, typename Size>
+template<typename I, typename>
+El const &BitmapHoleyArray<El, Size>::operator[](I const i) const {
+	return *getElementPointer<El>(mem, i, bucketSize);
+}
+
+// calls f with (filledI, oI, element)
+// the bitmap is read again after each call, so $f can destroy any element, and
+// the elements it creates after the one it's passed are visited too
+template<typename BitmapHoleyArray, typename F>
+void bitmapHoleyArrayForeachImpl(BitmapHoleyArray &arr, F &&f) {
+	typedef typename BitmapHoleyArray::FastSize Size;
+	Size filledI= 0;
+	for(Size wordI=0; wordI<arr.occupancy.size(); ++wordI)
+		for(U64 word= arr.occupancy[wordI]; word;) {
+			U8F const bitI= __builtin_ctzll(word);
+			f(filledI++, wordI*64 + bitI, arr[wordI*64 + bitI]);
+			// the bits after this one
+			word= bitI == 63 ? 0 : arr.occupancy[wordI] & ~U64{0} << (bitI + 1);
+		}
+}
+
+template<typename El, typename Size, typename F>
+void foreach(BitmapHoleyArray<El, Size> &arr, F &&f) {
+	bitmapHoleyArrayForeachImpl(arr, f);
+}
+template<typename El, typename Size, typename F>
+void foreach(BitmapHoleyArray<El, Size> const &arr, F &&f) {
+	bitmapHoleyArrayForeachImpl(arr, f);
+}
+
+template<typename El, typename Size>
+BitmapHoleyArray<El, Size>::~BitmapHoleyArray() {
+	foreach(*this, [](Size, Size, El &el) {
+		el.~El();
+	});
+	delete[] mem;
+}
+
+template<typename El, typename Size>
+Size size(BitmapHoleyArray<El, Size> const &arr) {
+	return arr.filledC;
+}
+
 // used by the client because array indices (player ids) need to match what the server says
 template<typename El, typename Size>
 struct ReplicaHoleyArray {
@@ -1009,7 +1162,8 @@ struct ReplicaHoleyArray {
 
 template<typename El, typename Size>
 ReplicaHoleyArray<El, Size>::ReplicaHoleyArray(Tag::Empty):
-	mem{nullptr}
+	mem{nullptr},
+	size{0}
 {}
 
 template<typename El, typename Size>
@@ -1020,6 +1174,36 @@ void allocate(ReplicaHoleyArray<El, Size> &arr, Size const size) {
 	arr.size= size;
 }
 
+// destroys the elements and frees the memory, so that it can be allocated again
+template<typename El, typename Size>
+void deallocate(ReplicaHoleyArray<El, Size> &arr) {
+	foreach(arr, [](Size, Size, El &el) {
+		el.~El();
+	});
+	arr.filledIs.clear();
+	delete[] arr.mem;
+	arr.mem= nullptr;
+	arr.size= 0;
+}
+
+// makes room for indices below $size, moving the elements if there isn't already
+template<typename El, typename Size>
+void reserve(ReplicaHoleyArray<El, Size> &arr, Size const size) {
+	ASSERT(arr.mem);
+	if(size <= arr.size)
+		return;
+	// not designed to handle El's ctor throwing an exception, like growArray
+	char *const newMem= allocAlignedMemory<El>(size);
+	for(Size const i: arr.filledIs) {
+		El &old= arr[i];
+		new(newMem + i*sizeof(El)) El{std::move(old)};
+		old.~El();
+	}
+	delete[] arr.mem;
+	arr.mem= newMem;
+	arr.size= size;
+}
+
 template<typename El, typename Size>
 template<typename I, typename>
 El &ReplicaHoleyArray<El, Size>::operator[](I const i) {
@@ -1066,3 +1250,9 @@ template<typename El, typename Size>
 Size size(ReplicaHoleyArray<El, Size> const &arr) {
 	return arr.filledIs.size();
 }
+
+// whether $i is one of $arr's elements, for indices from elsewhere that may not be
+template<typename El, typename Size, typename Index>
+bool isFilled(ReplicaHoleyArray<El, Size> const &arr, Index const i) {
+	return std::binary_search(begin(arr.filledIs), end(arr.filledIs), i);
+}
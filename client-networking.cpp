@@ -1,46 +1,314 @@
-#include<fcntl.h>
 #include<netinet/in.h>
 #include<netinet/tcp.h>
 #include<sys/socket.h>
 #include<unistd.h>
+#include<algorithm>
+#include<cmath>
+#include<cstring>
 #include<functional>
+#include<utility>
 #include"client.hpp"
 #include"common.hpp"
 #include"networking.hpp"
 #include"networking-impl.hpp"
 #include"memcpy.hpp"
+#include"varint.hpp"
 #include"vulkan.hpp"
 
+static void pushSample(OtherPlayer &player, PositionSample const &sample) {
+	player.samples[player.sampleC++ & (positionSampleC - 1)]= sample;
+}
+
+// adds $player.position, which has just arrived, to its samples, and adapts
+// its interpolation delay to how regularly they arrive
+static void samplePosition(OtherPlayer &player, std::chrono::steady_clock::time_point const now) {
+	// it's back in range, and isn't drawn moving from where it went out of range
+	if(std::exchange(player.isOutOfRange, false))
+		player.sampleC= 0;
+	if(player.sampleC) {
+		auto &newest= player.samples[(player.sampleC - 1) & (positionSampleC - 1)];
+		// arrived together, so only the later one's kept
+		if(now <= newest.time) {
+			newest.position= player.position;
+			return;
+		}
+		std::chrono::duration<float> const gap= now - newest.time;
+		if(maxInterpolationDelay < gap) {
+			// rather than being late, it wasn't sent, having stood still or been out
+			// of range, so it stays put until just before this one
+			pushSample(player, {
+				now - std::chrono::duration_cast<std::chrono::steady_clock::duration>(player.meanArrivalGap),
+				Position{newest.position}
+			});
+		} else {
+			player.arrivalJitter+= (std::chrono::abs(gap - player.meanArrivalGap) - player.arrivalJitter) / 4;
+			player.meanArrivalGap+= (gap - player.meanArrivalGap) / 8;
+		}
+	}
+	pushSample(player, {now, player.position});
+	player.interpolationDelay= std::clamp<std::chrono::duration<float>>(
+		player.meanArrivalGap + 4*player.arrivalJitter,
+		minInterpolationDelay,
+		maxInterpolationDelay
+	);
+}
+
+Position getInterpolatedPosition(OtherPlayer const &player, std::chrono::steady_clock::time_point const now) {
+	U32 const keptC= std::min(player.sampleC, positionSampleC);
+	auto const &getSample= [&player, keptC](U32 const i) -> PositionSample const& {
+		return player.samples[(player.sampleC - keptC + i) & (positionSampleC - 1)];
+	};
+	auto const time= now - std::chrono::duration_cast<std::chrono::steady_clock::duration>(player.interpolationDelay);
+	// past the newest sample, it stays there
+	if(!keptC || getSample(keptC - 1).time <= time)
+		return player.position;
+	U32 endI= 0;
+	for(; getSample(endI).time <= time; ++endI);
+	if(!endI)
+		return getSample(0).position;
+	auto const &start= getSample(endI - 1);
+	auto const &end= getSample(endI);
+	double const duration= std::chrono::duration<double>(end.time - start.time).count();
+	double const s= std::chrono::duration<double>(time - start.time).count() / duration;
+	// https://en.wikipedia.org/wiki/Cubic_Hermite_spline#Interpolation_on_an_arbitrary_interval
+	double const startWeight= (2*s - 3)*s*s + 1;
+	double const startTangentWeight= ((s - 2)*s + 1)*s * duration;
+	double const endWeight= (3 - 2*s)*s*s;
+	double const endTangentWeight= (s - 1)*s*s * duration;
+	// in position units per second, from the samples either side of sample $i
+	auto const &getTangent= [&getSample, keptC](U32 const i, U8F const componentI) {
+		auto const &before= getSample(i ? i - 1 : i);
+		auto const &after= getSample(i + 1 < keptC ? i + 1 : i);
+		return
+			(static_cast<double>(after.position[componentI].o) - before.position[componentI].o)
+			/ std::chrono::duration<double>(after.time - before.time).count();
+	};
+	Position ret{{0, 0, 0}};
+	for(U8F componentI=0; componentI<ret.size; ++componentI)
+		ret[componentI]= {Tag::fromInner, static_cast<S32>(std::lround(
+			startWeight*start.position[componentI].o
+			+ startTangentWeight*getTangent(endI - 1, componentI)
+			+ endWeight*end.position[componentI].o
+			+ endTangentWeight*getTangent(endI, componentI)
+		))};
+	return ret;
+}
+
+static void publishOtherPlayers(void *const ns_) {
+	auto &ns= *static_cast<NetworkingState*>(ns_);
+	ns.willPublishOtherPlayers= false;
+	auto &drawn= getBack(ns.drawnOtherPlayers);
+	drawn.clear();
+	foreach(ns.otherPlayers, [&drawn](auto, auto, OtherPlayer const &player) {
+		if(!player.isOutOfRange)
+			drawn.push_back(player);
+	});
+	publishBack(ns.drawnOtherPlayers);
+}
+
+// the renderer sees the other players as they are once this batch of reactions is done
+static void publishOtherPlayersAtEndOfBatch(NetworkingState &ns, EpollReactor &reactor) {
+	if(std::exchange(ns.willPublishOtherPlayers, true))
+		return;
+	deferToEndOfBatch(reactor.reactorThreads[connectionThreadI], publishOtherPlayers, &ns);
+}
+
+// decodes the payload of a type-5 message, and acknowledges it so that the
+// server encodes later ones relative to it
+static void handlePositionDeltas(
+	NetworkingState &ns,
+	char const *const body,
+	U32 const byteC,
+	EpollReactor &reactor
+) {
+	U32 sequence, baselineSequence;
+	Sync::PlayerC playerC;
+	if(byteC < 3*sizeof(U32))
+		return;
+	memcpyInit(sequence, body + 0*sizeof(U32));
+	memcpyInit(baselineSequence, body + 1*sizeof(U32));
+	memcpyInit(playerC, body + 2*sizeof(U32));
+	auto const bitmaskI= 3*sizeof(U32);
+	U32F const deltasI= bitmaskI + (playerC + 7)/8;
+	if(byteC < deltasI)
+		return;
+	auto const *const baseline= findDeltaBaseline(ns.receivedBaselines, baselineSequence);
+	// the server only encodes relative to baselines that we still have
+	if(baselineSequence && !baseline)
+		return;
+	// a malformed message is checked for before anything's changed, and isn't acknowledged
+	U32F scanI= deltasI;
+	for(U32F filledI=0; filledI<playerC; ++filledI)
+		if(body[bitmaskI + filledI/8] >> filledI%8 & 1)
+			for(U8F componentI=0; componentI<3; ++componentI) {
+				U64 zigZagged;
+				auto const varintByteC= readVarint(zigZagged, body + scanI, byteC - scanI);
+				if(!varintByteC)
+					return;
+				scanI+= varintByteC;
+			}
+	scanI= deltasI;
+	// the positions can't be matched up with the players. this message isn't
+	// acknowledged, so later ones aren't encoded relative to it
+	if(playerC != size(ns.otherPlayers))
+		return;
+	auto &current= replaceDeltaBaseline(ns.receivedBaselines, sequence);
+	std::size_t baselineI= 0;
+	auto const now= std::chrono::steady_clock::now();
+	foreach(ns.otherPlayers,
+		[&](auto const filledI, auto const playerI, OtherPlayer &player) {
+			UpdatePos position{0, 0, 0};
+			if(baseline) {
+				auto const &basePositions= baseline->positions;
+				for(; baselineI < basePositions.size() && basePositions[baselineI].first < playerI; ++baselineI);
+				if(baselineI < basePositions.size() && basePositions[baselineI].first == playerI)
+					position= basePositions[baselineI].second;
+			}
+			if(body[bitmaskI + filledI/8] >> filledI%8 & 1)
+				for(S32 *const component : {&position.x, &position.y, &position.z}) {
+					U64 zigZagged;
+					// checked above
+					scanI+= readVarint(zigZagged, body + scanI, byteC - scanI);
+					// the difference wraps around, like it did when it was encoded
+					*component= static_cast<S32>(
+						static_cast<U32>(*component)
+						+ static_cast<U32>(zigZagDecode(static_cast<U32>(zigZagged)))
+					);
+				}
+			current.positions.emplace_back(playerI, position);
+			getX(player.position)= {Tag::fromInner, position.x};
+			getY(player.position)= {Tag::fromInner, position.y};
+			getZ(player.position)= {Tag::fromInner, position.z};
+			samplePosition(player, now);
+		}
+	);
+	publishOtherPlayersAtEndOfBatch(ns, reactor);
+	scheduleSocketWrite(*ns.socket, serialiseMessage(MessageType{1}, sequence), reactor);
+}
+
+// the payload of a type-3 message, which sets every other player's position
+static void handleAllPositions(
+	NetworkingState &ns,
+	char const *const payload,
+	U32 const payloadByteC,
+	EpollReactor &reactor
+) {
+	// the positions can't be matched up with the players, and the next
+	// message sets them all anyway
+	if(payloadByteC != 3*sizeof(getX(OtherPlayer::position)) * size(ns.otherPlayers))
+		return;
+	auto const now= std::chrono::steady_clock::now();
+	foreach(ns.otherPlayers, [payload, now](auto const i, auto, auto &player) {
+		memcpyInit(getX(player.position), payload + (0 + 3*i)*sizeof(Position::El));
+		memcpyInit(getY(player.position), payload + (1 + 3*i)*sizeof(Position::El));
+		memcpyInit(getZ(player.position), payload + (2 + 3*i)*sizeof(Position::El));
+		samplePosition(player, now);
+	});
+	publishOtherPlayersAtEndOfBatch(ns, reactor);
+}
+
+static double getElapsedFraction(
+	std::chrono::steady_clock::rep const start,
+	std::chrono::steady_clock::time_point const now,
+	std::chrono::steady_clock::duration const length
+) {
+	std::chrono::steady_clock::time_point const startTime{std::chrono::steady_clock::duration{start}};
+	return std::clamp(std::chrono::duration<double>(now - startTime) / length, 0., 1.);
+}
+static UpdatePos interpolate(UpdatePos const &a, UpdatePos const &b, double const fraction) {
+	auto const lerp= [&](S32 const from, S32 const to) {
+		return static_cast<S32>(std::lround(from + (static_cast<double>(to) - from)*fraction));
+	};
+	return {lerp(a.x, b.x), lerp(a.y, b.y), lerp(a.z, b.z)};
+}
+// where on its way from $motion.from to $motion.to the player is, leaving out the correction
+static UpdatePos getMovedPosition(PredictedMotion const &motion, std::chrono::steady_clock::time_point const now) {
+	return interpolate(motion.from, motion.to, getElapsedFraction(motion.startTime, now, inputTick));
+}
+static UpdatePos getCorrection(PredictedMotion const &motion, std::chrono::steady_clock::time_point const now) {
+	return interpolate(motion.correction, {0, 0, 0}, getElapsedFraction(motion.correctionTime, now, correctionFadeTime));
+}
+UpdatePos getDrawnPosition(PredictedMotion const &motion, std::chrono::steady_clock::time_point const now) {
+	auto const moved= getMovedPosition(motion, now);
+	auto const correction= getCorrection(motion, now);
+	return {moved.x + correction.x, moved.y + correction.y, moved.z + correction.z};
+}
+
+// the inputs from $ns.playedInputSequence on, starting from where the server
+// left the player after playing those before. the difference from what was
+// predicted fades out where it's drawn, so that the camera doesn't jump
+static void predictPosition(NetworkingState &ns, UpdatePos position) {
+	U32 const oldestPendingSequence= ns.nextInputSequence - pendingInputC;
+	for(
+		U32 sequence= isNewerSequence(oldestPendingSequence, ns.playedInputSequence)
+			? oldestPendingSequence
+			: ns.playedInputSequence + 1;
+		sequence != ns.nextInputSequence;
+		++sequence
+	)
+		applyInput(position, ns.pendingInputs[sequence & (pendingInputC - 1)]);
+	auto motion= loadConsistent(ns.predictedMotion);
+	if(position == motion.to)
+		return;
+	auto const now= std::chrono::steady_clock::now();
+	UpdatePos const shift{position.x - motion.to.x, position.y - motion.to.y, position.z - motion.to.z};
+	auto const correction= getCorrection(motion, now);
+	// shifting the motion by $shift and the correction by the opposite leaves
+	// where it's drawn unchanged
+	motion.from= {motion.from.x + shift.x, motion.from.y + shift.y, motion.from.z + shift.z};
+	motion.to= position;
+	motion.correction= {correction.x - shift.x, correction.y - shift.y, correction.z - shift.z};
+	motion.correctionTime= now.time_since_epoch().count();
+	publish(ns.predictedMotion, motion);
+}
+
+// each message's payload is at $payload, the frame header says how long it is
 static auto const handleMessage= [](
 	NetworkingState &ns,
+	EpollReactor &reactor,
 	MessageType const messageType,
-	char const *const scanPos,
-	auto const remainingByteC
-)->FastInteger<MessageBufSize> {
+	char const *const payload,
+	U32 const payloadByteC
+) {
 	switch(messageType) {
 	case 0: {
 			Sync::PlayerC playerC;
-			if(remainingByteC < sizeof playerC)
-				return -1;
-			memcpyInit(playerC, scanPos);
+			if(payloadByteC < sizeof playerC)
+				return;
+			memcpyInit(playerC, payload);
 			std::cout << "received player count: " << playerC << "!\n";
-			// TODO: this message can be arbitrarily long, so it might not fit
-			// inside the stream read buffer, in that case it needs to be read
-			// piece by piece, which is as-of-yet unimplemented. it might be
-			// easier to limit the length of the message, possibly by sending
-			// multiple of these messages.
-			if(remainingByteC < sizeof playerC + playerC*sizeof(Sync::PlayerI))
-				return -1;
+			// this message can be arbitrarily long, but the whole frame is received before it's handled
+			if(payloadByteC < sizeof playerC + std::size_t{playerC}*sizeof(Sync::PlayerI))
+				return;
 			auto const playerCBufSize= playerC * sizeof(Sync::PlayerI);
 			auto const playerIs= std::make_unique<Sync::PlayerI[]>(playerC);
-			std::memcpy(playerIs.get(), scanPos + sizeof playerC, playerCBufSize);
-			{
-				std::lock_guard g{ns.mutex};
-				allocate(ns.otherPlayers, 5u);
-				for(U16F playerII= 0; playerII < playerC; ++playerII)
+			std::memcpy(playerIs.get(), payload + sizeof playerC, playerCBufSize);
+			// the list has room for the highest id, and a message with an id
+			// that no server sends is dropped before anything's added
+			U32L slotC= 0;
+			for(FastInteger<Sync::PlayerC> i=0; i<playerC; ++i) {
+				if(maxPlayerC <= playerIs[i])
+					return;
+				slotC= std::max<U32L>(slotC, playerIs[i] + 1);
+			}
+			++ns.receivedMembershipNoticeC;
+			if(!ns.otherPlayers.mem)
+				allocate(ns.otherPlayers, slotC);
+			else {
+				// a resync, so whoever isn't listed has gone, and whoever still is
+				// keeps their samples
+				reserve(ns.otherPlayers, slotC);
+				std::sort(playerIs.get(), playerIs.get() + playerC);
+				auto const filledIs= ns.otherPlayers.filledIs;
+				for(U32L const i: filledIs)
+					if(!std::binary_search(playerIs.get(), playerIs.get() + playerC, i))
+						destroy(ns.otherPlayers, i);
+			}
+			for(FastInteger<Sync::PlayerC> playerII= 0; playerII < playerC; ++playerII)
+				if(!isFilled(ns.otherPlayers, playerIs[playerII]))
 					// todo: should the server send the other players' positions in the initial update?
 					emplace(ns.otherPlayers, playerIs[playerII], Position{{0, 0, 0}});
-			}
+			publishOtherPlayersAtEndOfBatch(ns, reactor);
 			std::cout << "players with these ids are already playing: ";
 			bool isInitial= true;
 			for(FastInteger<Sync::PlayerC> i=0; i<playerC; ++i) {
@@ -51,113 +319,346 @@ static auto const handleMessage= [](
 				std::cout << playerIs[i];
 			}
 			std::cout << '\n';
-			return sizeof playerC + playerCBufSize;
+			return;
 		}
 	case 1:
 		Sync::PlayerI newPlayerI;
-		if(remainingByteC < sizeof newPlayerI)
-			return -1;
-		memcpyInit(newPlayerI, scanPos);
-		{
-			std::lock_guard g{ns.mutex};
-			emplace(ns.otherPlayers, newPlayerI, Position{{0, 0, 0}});
-		}
+		if(payloadByteC < sizeof newPlayerI)
+			return;
+		memcpyInit(newPlayerI, payload);
+		// no server sends these
+		if(maxPlayerC <= newPlayerI || !ns.otherPlayers.mem || isFilled(ns.otherPlayers, newPlayerI))
+			return;
+		++ns.receivedMembershipNoticeC;
+		// grown by half at a time, so that players joining one by one don't each move them all
+		if(ns.otherPlayers.size <= newPlayerI)
+			reserve(ns.otherPlayers, std::max<U32L>(newPlayerI + 1, ns.otherPlayers.size + ns.otherPlayers.size/2));
+		emplace(ns.otherPlayers, newPlayerI, Position{{0, 0, 0}});
+		publishOtherPlayersAtEndOfBatch(ns, reactor);
 		std::cout << "new player joined with id " << newPlayerI << "\n";
-		return sizeof newPlayerI;
+		return;
 	case 2:
 		Sync::PlayerI disconnectedPlayerI;
-		if(remainingByteC < sizeof disconnectedPlayerI)
-			return -1;
-		memcpyInit(disconnectedPlayerI, scanPos);
-		{
-			std::lock_guard g{ns.mutex};
-			destroy(ns.otherPlayers, disconnectedPlayerI);
-		}
+		if(payloadByteC < sizeof disconnectedPlayerI)
+			return;
+		memcpyInit(disconnectedPlayerI, payload);
+		// nor these
+		if(!isFilled(ns.otherPlayers, disconnectedPlayerI))
+			return;
+		++ns.receivedMembershipNoticeC;
+		destroy(ns.otherPlayers, disconnectedPlayerI);
+		publishOtherPlayersAtEndOfBatch(ns, reactor);
 		std::cout << "player disconnected with id " << disconnectedPlayerI << "\n";
-		return sizeof disconnectedPlayerI;
+		return;
 	case 3:
+		handleAllPositions(ns, payload, payloadByteC, reactor);
+		return;
+	case 4:
 		{
-			std::lock_guard g{ns.mutex};
-			std::size_t const msgLen= 3*sizeof(getX(OtherPlayer::position)) * size(ns.otherPlayers);
-			if(remainingByteC < msgLen)
-				return -1;
-			foreach(ns.otherPlayers, [scanPos](auto const i, auto, auto &player) {
-				memcpyInit(getX(player.position), scanPos + (0 + 3*i)*sizeof(Position::El));
-				memcpyInit(getY(player.position), scanPos + (1 + 3*i)*sizeof(Position::El));
-				memcpyInit(getZ(player.position), scanPos + (2 + 3*i)*sizeof(Position::El));
-			});
-			return msgLen;
+			Sync::PlayerC playerC;
+			if(payloadByteC < sizeof playerC)
+				return;
+			memcpyInit(playerC, payload);
+			auto constexpr entryByteC= sizeof(Sync::PlayerI) + 3*sizeof(Position::El);
+			if(payloadByteC < sizeof playerC + std::size_t{playerC}*entryByteC)
+				return;
+			auto const now= std::chrono::steady_clock::now();
+			// players not listed are left where they were last seen, and those
+			// that went out of range are hidden until they're listed again
+			for(FastInteger<Sync::PlayerC> i=0; i<playerC; ++i) {
+				char const *const entry= payload + sizeof playerC + i*entryByteC;
+				Sync::PlayerI playerI;
+				memcpyInit(playerI, entry);
+				bool const isOutOfRange= playerI & outOfRangeFlag;
+				playerI&= ~outOfRangeFlag;
+				// the server never lists players it hasn't told us about, but it's not trusted to
+				if(!isFilled(ns.otherPlayers, playerI))
+					continue;
+				auto &player= ns.otherPlayers[playerI];
+				memcpyInit(getX(player.position), entry + sizeof playerI + 0*sizeof(Position::El));
+				memcpyInit(getY(player.position), entry + sizeof playerI + 1*sizeof(Position::El));
+				memcpyInit(getZ(player.position), entry + sizeof playerI + 2*sizeof(Position::El));
+				if(isOutOfRange)
+					player.isOutOfRange= true;
+				else
+					samplePosition(player, now);
+			}
+			publishOtherPlayersAtEndOfBatch(ns, reactor);
+			return;
+		}
+	case 5:
+		handlePositionDeltas(ns, payload, payloadByteC, reactor);
+		return;
+	case 6:
+		{
+			U64 token;
+			if(payloadByteC < sizeof token)
+				return;
+			memcpyInit(token, payload);
+			ns.udpToken= token;
+			return;
+		}
+	case 7:
+		{
+			U32 sequence;
+			UpdatePos position;
+			if(payloadByteC < sizeof sequence + UpdatePosMessageLength)
+				return;
+			memcpyInit(sequence, payload);
+			memcpyInit(position, payload + sizeof sequence);
+			// it's superseded by one that was already handled
+			if(!isNewerSequence(sequence, ns.playedInputSequence))
+				return;
+			ns.playedInputSequence= sequence;
+			predictPosition(ns, position);
+			return;
 		}
 	default:
-		std::cout << "received an unknown message type, can't continue processing messages\n";
-		ASSERT(false);
+		// from a newer server, its frame says how much to skip
+		return;
 	}
 };
 
+// each datagram from the server is a sequence number, the count of
+// membership notices it had sent when it sent the datagram, and a type-3 message
+static void handleServerDatagrams(void *const data, U32 const events, ReactionExecutionInfo const execInfo) {
+	auto &ns= assertExists(static_cast<Program*>(data)).networkingState;
+	receiveDatagrams(ns.udpSocket.fd, [&ns, &reactor= execInfo.thisReactor](Datagram const *const datagrams, U32 const datagramC) {
+		U32 constexpr headerByteC= 2*sizeof(U32);
+		// only the newest datagram of the batch matters
+		Datagram const *newest= nullptr;
+		for(U32 i=0; i<datagramC; ++i) {
+			U32 sequence;
+			if(datagrams[i].byteC < headerByteC)
+				continue;
+			memcpyInit(sequence, datagrams[i].data);
+			if(!isNewerSequence(sequence, ns.newestUdpSequence))
+				continue;
+			ns.newestUdpSequence= sequence;
+			newest= &datagrams[i];
+		}
+		if(!newest)
+			return;
+		U32 membershipNoticeC;
+		memcpyInit(membershipNoticeC, newest->data + sizeof(U32));
+		Frame frame;
+		if(
+			decodeFrame(frame, newest->data + headerByteC, newest->byteC - headerByteC)
+				!= FrameDecodeResult::complete
+			|| frame.type != MessageType{3}
+		)
+			return;
+		// it came round a join or leave on the TCP socket, so it's about a different set of players
+		if(membershipNoticeC != ns.receivedMembershipNoticeC)
+			return;
+		handleAllPositions(ns, frame.payload, frame.payloadByteC, reactor);
+	});
+}
+
+static sockaddr_in getServerAddr() {
+	sockaddr_in ret{};
+	ret.sin_family= AF_INET;
+	ret.sin_port= htons(port);
+	char constexpr serverAddrMem[] { 127, 0, 0, 1 };
+	std::memcpy(&ret.sin_addr.s_addr, serverAddrMem, sizeof ret.sin_addr.s_addr);
+	return ret;
+}
+
 auto constexpr &socketFunc= *socket;
-NetworkingState::NetworkingState(Program &program): socket{
-	program.reactor,
-	[]{
-		// https://riptutorial.com/posix/example/17612/tcp-daytime-client
-		// connect to the server
-		signed const tcpConnSockFd= socketFunc(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-		PERROR_ASSERT(0 <= tcpConnSockFd);
-		signed const noDelayOption= 1;
-		setsockopt(tcpConnSockFd, SOL_SOCKET, TCP_NODELAY, &noDelayOption, sizeof noDelayOption);
-		sockaddr_in serverAddr{};
-		serverAddr.sin_family= AF_INET;
-		serverAddr.sin_port= htons(port);
-		char constexpr serverAddrMem[] { 127, 0, 0, 1 };
-		std::memcpy(&serverAddr.sin_addr.s_addr, serverAddrMem, sizeof serverAddr.sin_addr.s_addr);
-		std::cout << "connecting...\n";
-		// connect synchronously
-		PERROR_ASSERT(0 == connect(
+
+static void connectToServer(Program&);
+static void handleServerSocketReady(void *data, U32 events, ReactionExecutionInfo);
+
+static void connectFromTimer(void *const data, ReactionExecutionInfo) {
+	connectToServer(assertExists(static_cast<Program*>(data)));
+}
+
+// the delay is between half of $ns.reconnectDelay and all of it
+static void scheduleReconnection(Program &program) {
+	auto &ns= program.networkingState;
+	auto const delay= std::uniform_int_distribution<std::chrono::steady_clock::rep>{
+		ns.reconnectDelay.count() / 2,
+		ns.reconnectDelay.count()
+	}(ns.reconnectRandom);
+	std::cout
+		<< "reconnecting in "
+		<< std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::duration{delay}).count()
+		<< "ms...\n";
+	addOneShotTimerReaction(
+		program.reactor,
+		connectionThreadI,
+		std::chrono::steady_clock::duration{delay},
+		TimerReaction{ *connectFromTimer, { Tag::notDeleted, &program } }
+	);
+	ns.reconnectDelay= std::min<std::chrono::steady_clock::duration>(2*ns.reconnectDelay, maxReconnectDelay);
+}
+
+// forgets what the server said over the lost connection, since the next
+// connection starts with a type-0 message about whoever's there by then
+static void handleDisconnection(Program &program, ReactionExecutionInfo const execInfo) {
+	auto &ns= program.networkingState;
+	PERROR_ASSERT(0 == close(ns.socket->fd));
+	removeReactionFromThisThread(getThisThread(execInfo), *ns.socket->reactionHandle.reaction);
+	ns.socket.reset();
+	ns.isConnected= false;
+	ns.udpToken= 0;
+	ns.newestUdpSequence= 0;
+	// nothing will say whether the server played them
+	ns.playedInputSequence= ns.nextInputSequence - 1;
+	for(auto &baseline : ns.receivedBaselines)
+		baseline= {};
+	if(ns.otherPlayers.mem)
+		deallocate(ns.otherPlayers);
+	ns.receivedMembershipNoticeC= 0;
+	publishOtherPlayersAtEndOfBatch(ns, execInfo.thisReactor);
+	scheduleReconnection(program);
+}
+
+// starts connecting, and the socket's reaction finds out how that went
+static void connectToServer(Program &program) {
+	auto &ns= program.networkingState;
+	// https://riptutorial.com/posix/example/17612/tcp-daytime-client
+	signed const tcpConnSockFd= socketFunc(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+	PERROR_ASSERT(0 <= tcpConnSockFd);
+	signed const noDelayOption= 1;
+	setsockopt(tcpConnSockFd, IPPROTO_TCP, TCP_NODELAY, &noDelayOption, sizeof noDelayOption);
+	sockaddr_in const serverAddr= getServerAddr();
+	std::cout << "connecting...\n";
+	PERROR_ASSERT(
+		0 == connect(
 			tcpConnSockFd,
-			&reinterpret_cast<sockaddr&>(serverAddr),
+			&reinterpret_cast<sockaddr const&>(serverAddr),
 			sizeof serverAddr
-		));
-		// make the socket asynchronous now
-		fcntl(tcpConnSockFd, F_SETFL, O_NONBLOCK);
-		return tcpConnSockFd;
-	}(),
-	defaultSocketEvents,
-	{
-		*[](void *const data, U32 const events, ReactionExecutionInfo const execInfo){
-			auto &program= assertExists(static_cast<Program*>(data));
-			auto &socket= program.networkingState.socket;
-			handleMessageStreamReadable(
-				socket.fd, socket.asyncRead,
-				// handle message
-				[&ns= program.networkingState](
-					MessageType const messageType,
-					char const *const scanPos,
-					auto const remainingByteC
-				) { return handleMessage(ns, messageType, scanPos, remainingByteC); },
-				// handle end of stream
-				[]{
-					std::cout << "end of stream, server disconnected!\n";
-					UNIMPLEMENTED;
-				}
-			);
-		},
-		{ Tag::notDeleted, &program }
+		)
+		|| EINPROGRESS == errno
+	);
+	// it's writable once it's connected, or once connecting failed
+	ns.socket= std::make_unique<AsyncSocket>(
+		program.reactor,
+		connectionThreadI,
+		tcpConnSockFd,
+		defaultSocketEvents | EPOLLOUT,
+		FdReaction{ handleServerSocketReady, { Tag::notDeleted, &program } }
+	);
+}
+
+static void handleServerSocketReady(void *const data, U32 const events, ReactionExecutionInfo const execInfo) {
+	auto &program= assertExists(static_cast<Program*>(data));
+	auto &ns= program.networkingState;
+	auto &socket= *ns.socket;
+	if(!ns.isConnected) {
+		signed connectError;
+		socklen_t connectErrorByteC= sizeof connectError;
+		PERROR_ASSERT(0 == getsockopt(socket.fd, SOL_SOCKET, SO_ERROR, &connectError, &connectErrorByteC));
+		// with the uring backend, a failed receive can take the error before this sees it
+		if(connectError || events & EPOLLHUP) {
+			std::cout << "couldn't connect: " << (connectError ? std::strerror(connectError) : "hung up") << '\n';
+			handleDisconnection(program, execInfo);
+			return;
+		}
+		if(!(events & EPOLLOUT))
+			return;
+		std::cout << "connected!\n";
+		ns.isConnected= true;
+		ns.reconnectDelay= minReconnectDelay;
+		// and the EPOLLOUT that said so is handled below, which stops asking for it
 	}
-} {
-	addTimerReaction(program.reactor, positionUpdateInterval, TimerReaction{
-		*[](void *data, ReactionExecutionInfo const execInfo){
-			auto &program= assertExists(static_cast<Program*>(data));
-			// send a position update
-			auto const &cam= program.vulkanWindow.statics.camera;
-			UpdatePos const update{
-				getX(cam.position).o,
-				getY(cam.position).o,
-				getZ(cam.position).o,
-			};
-			char buf[sizeof(MessageType) + sizeof update];
-			memcpyInspect(buf, MessageType{0});
-			memcpyInspect(buf + sizeof(MessageType), update);
-			scheduleSocketWrite(program.networkingState.socket, {buf}, execInfo.thisReactor);
-		},
+	bool isDisconnected= false;
+	handleMessageStreamReadable(
+		socket, execInfo,
+		// handle message
+		[&ns, &reactor= execInfo.thisReactor](
+			MessageType const messageType,
+			char const *const payload,
+			U32 const payloadByteC
+		) { handleMessage(ns, reactor, messageType, payload, payloadByteC); },
+		// handle end of stream
+		[&program, execInfo, &isDisconnected]{
+			std::cout << "end of stream, server disconnected!\n";
+			handleDisconnection(program, execInfo);
+			isDisconnected= true;
+		}
+	);
+	if(!isDisconnected && events & EPOLLOUT)
+		handleMessageStreamWritable(socket, execInfo);
+}
+
+// makes this tick's input, moves the player as the server will once it plays
+// it, and sends the server the inputs that it hasn't played yet
+static void makeInput(void *const data, ReactionExecutionInfo const execInfo) {
+	auto &ns= assertExists(static_cast<Program*>(data)).networkingState;
+	U32 const sequence= ns.nextInputSequence++;
+	auto const input= loadConsistent(ns.heldInput);
+	ns.pendingInputs[sequence & (pendingInputC - 1)]= input;
+	auto motion= loadConsistent(ns.predictedMotion);
+	auto const now= std::chrono::steady_clock::now();
+	// glides on from where it's drawn now, over this input's tick
+	motion.from= getMovedPosition(motion, now);
+	applyInput(motion.to, input);
+	motion.startTime= now.time_since_epoch().count();
+	publish(ns.predictedMotion, motion);
+	if(!ns.isConnected) {
+		// the player moves about on its own until it's connected
+		ns.playedInputSequence= sequence;
+		return;
+	}
+	U8 const inputC= std::min<U32>(sequence - ns.playedInputSequence, maxSentInputC);
+	std::vector<char> message(maxFrameHeaderByteC + sizeof sequence + sizeof inputC + inputC*inputByteC);
+	char *const payload= message.data() + maxFrameHeaderByteC;
+	memcpyInspect(payload, sequence);
+	memcpyInspect(payload + sizeof sequence, inputC);
+	// oldest first
+	for(U8F i=0; i<inputC; ++i) {
+		auto const &pendingInput= ns.pendingInputs[(sequence - (inputC - 1 - i)) & (pendingInputC - 1)];
+		char *const dst= payload + sizeof sequence + sizeof inputC + i*inputByteC;
+		memcpyInspect(dst, pendingInput.buttons);
+		memcpyInspect(dst + sizeof pendingInput.buttons, pendingInput.yaw);
+	}
+	auto const frame= finishFrame(message, MessageType{2});
+	if(!ns.udpToken) {
+		scheduleSocketWrite(*ns.socket, frame, execInfo.thisReactor);
+		return;
+	}
+	U32 const udpSequence= ns.nextUdpSequence++;
+	char header[sizeof ns.udpToken + sizeof udpSequence];
+	memcpyInspect(header, ns.udpToken);
+	memcpyInspect(header + sizeof ns.udpToken, udpSequence);
+	iovec iovs[] {
+		{ header, sizeof header },
+		{ const_cast<char*>(frame.o), frame.size },
+	};
+	mmsghdr udpMessage{};
+	udpMessage.msg_hdr.msg_iov= iovs;
+	udpMessage.msg_hdr.msg_iovlen= std::size(iovs);
+	sendDatagrams(ns.udpSocket, &udpMessage, 1);
+}
+
+NetworkingState::NetworkingState(Program &program):
+udpSocket{[]{
+	signed const udpSockFd= socketFunc(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+	PERROR_ASSERT(0 <= udpSockFd);
+	// so that only the server's datagrams are received
+	sockaddr_in const serverAddr= getServerAddr();
+	PERROR_ASSERT(0 == connect(
+		udpSockFd,
+		&reinterpret_cast<sockaddr const&>(serverAddr),
+		sizeof serverAddr
+	));
+	return udpSockFd;
+}()} {
+	// the connection is made from its own thread, so that this doesn't wait for it
+	addOneShotTimerReaction(
+		program.reactor,
+		connectionThreadI,
+		std::chrono::steady_clock::duration::zero(),
+		TimerReaction{ *connectFromTimer, { Tag::notDeleted, &program } }
+	);
+	addFdReaction(program.reactor, connectionThreadI, udpSocket.fd, EPOLLIN, {
+		handleServerDatagrams,
+		{ Tag::notDeleted, &program }
+	});
+	addTimerReaction(program.reactor, connectionThreadI, inputTick, TimerReaction{
+		*makeInput,
 		{ Tag::notDeleted, &program }
 	});
 }
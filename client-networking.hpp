@@ -1,24 +1,100 @@
 #pragma once
-#include<queue>
+#include<array>
+#include<chrono>
+#include<memory>
+#include<random>
 #include"array.hpp"
 #include"networking.hpp"
 #include"position/cpp.hpp"
 
-struct PosUpdate {
-	U32 playerI;
-	float x,y,z;
-};
-struct RenderUpdateQueue {
-	std::queue<PosUpdate> queue;
-	std::mutex mutex;
+// a position that a remote player was seen at, and when it arrived
+struct PositionSample {
+	std::chrono::steady_clock::time_point time;
+	Position position{{0, 0, 0}};
 };
+// a power of 2, and enough to cover maxInterpolationDelay at positionUpdateInterval
+U32 constexpr positionSampleC= 32;
+// remote players are drawn this far in the past, so that the position after the
+// one drawn has usually arrived. each one's delay is between these, depending
+// on how regularly its positions arrive
+auto constexpr minInterpolationDelay= 2*positionUpdateInterval;
+auto constexpr maxInterpolationDelay= std::chrono::milliseconds{250};
+static_assert(maxInterpolationDelay < positionSampleC*positionUpdateInterval);
 struct OtherPlayer {
+	// the newest one received
 	Position position;
+	// the recent positions, oldest first from $sampleC, which is how many have been received
+	std::array<PositionSample, positionSampleC> samples;
+	U32 sampleC= 0;
+	// smoothed like TCP's round-trip time estimate (RFC 6298): the mean time
+	// between arrivals, and the mean deviation from it
+	std::chrono::duration<float> meanArrivalGap= positionUpdateInterval;
+	std::chrono::duration<float> arrivalJitter{};
+	std::chrono::duration<float> interpolationDelay= minInterpolationDelay;
+	// it was last said to be outside of our interest radius, so it isn't drawn
+	bool isOutOfRange= false;
 };
+// where to draw $player at $now, on a cubic Hermite spline through its
+// samples, $player.interpolationDelay in the past
+Position getInterpolatedPosition(OtherPlayer const &player, std::chrono::steady_clock::time_point now);
 struct Program;
+// the connection to the server, its timers and the UDP socket's reaction are
+// all on this reactor thread, so that what they share needs no locking
+U32 constexpr connectionThreadI= 0;
+// the delay before reconnecting doubles after each failed attempt, between these
+auto constexpr minReconnectDelay= std::chrono::milliseconds{100};
+auto constexpr maxReconnectDelay= std::chrono::seconds{5};
+// a power of 2. inputs that the server still hasn't played once this many newer
+// ones were made are forgotten, and its position corrects for them instead
+U32 constexpr pendingInputC= 256;
+// each type-2 message repeats up to this many of the newest unplayed inputs,
+// so that a lost datagram doesn't lose its inputs
+U8 constexpr maxSentInputC= 32;
+static_assert(maxSentInputC < pendingInputC);
+// how long the drawn position takes to catch up with a correction from the server
+auto constexpr correctionFadeTime= std::chrono::milliseconds{100};
+// where the player's drawn: it glides from $from to $to over the inputTick from
+// $startTime, so that the camera moves every frame rather than every input, and
+// is off by $correction, which fades out over correctionFadeTime from
+// $correctionTime, so that corrections aren't jumps. the times are steady clock ticks
+struct PredictedMotion {
+	UpdatePos from, to, correction;
+	std::chrono::steady_clock::rep startTime, correctionTime;
+};
+UpdatePos getDrawnPosition(PredictedMotion const&, std::chrono::steady_clock::time_point now);
 struct NetworkingState {
 	ReplicaHoleyArray<OtherPlayer, U32L> otherPlayers{Tag::empty};
-	std::mutex mutex;
-	AsyncSocket socket;
+	// copies of the filled ones of $otherPlayers, which the renderer draws
+	// from, so that it never waits for messages to be handled
+	TripleBuffer<std::vector<OtherPlayer>> drawnOtherPlayers;
+	// set while publishing them is deferred to the end of the batch
+	bool willPublishOtherPlayers= false;
+	// the positions received in the most recent type-5 messages
+	DeltaBaselines receivedBaselines{Tag::defaultInitialise};
+	// the count of type-0, 1 and 2 messages received
+	U32 receivedMembershipNoticeC= 0;
+	// positions go over UDP once the server sends this in a type-6 message, 0 until then
+	U64 udpToken= 0;
+	U32 nextUdpSequence= 1;
+	U32 newestUdpSequence= 0;
+	UdpSocket udpSocket;
+	// null while waiting to reconnect
+	std::unique_ptr<AsyncSocket> socket;
+	// false while $socket is still connecting
+	bool isConnected= false;
+	std::chrono::steady_clock::duration reconnectDelay= minReconnectDelay;
+	// spreads out the reconnections of clients that lost the same server
+	std::minstd_rand reconnectRandom{std::random_device{}()};
+	// what the renderer says the player's doing, which each input is made from
+	Seqlock<PlayerInput> heldInput{PlayerInput{}};
+	// $to is where the player will be once the server plays its inputs, and
+	// the renderer puts the camera where it's drawn
+	Seqlock<PredictedMotion> predictedMotion{PredictedMotion{spawnPosition, spawnPosition, {0, 0, 0}, 0, 0}};
+	// these are only accessed from connectionThreadI
+	// the inputs after $playedInputSequence, by sequence number modulo pendingInputC
+	std::array<PlayerInput, pendingInputC> pendingInputs;
+	U32 nextInputSequence= 1;
+	// the newest input that the server said it played
+	U32 playedInputSequence= 0;
 	NetworkingState(Program&);
 };
@@ -1,15 +1,27 @@
+#include<algorithm> // std::binary_search, std::fill, std::max, std::min
 #include<atomic> // std::compare_exchange_weak
+#include<chrono> // std::chrono::ceil, std::chrono::floor
 #include<functional> // std::reference_wrapper
-#include<optional> // std::optional
+#include<memory> // std::make_unique
 #include<sys/epoll.h> // epoll_create, epoll_ctl, epoll_wait, epoll_event
 #include<sys/eventfd.h> // eventfd
+#include<sys/socket.h> // MSG_NOSIGNAL, SOCK_NONBLOCK
+#include<sys/timerfd.h> // timerfd_create, timerfd_settime
 #include<tuple>
-#include<unistd.h> // write
+#include<utility> // std::pair
+#include<unistd.h> // read, write
 #include"common.hpp"
 #include"concurrency.hpp"
 
 unsigned constexpr epollCreateHint= 10;
 unsigned constexpr maxEventC= 64;
+// each thread's ring has room for the entries that a batch of reactions submits,
+// and for many more completions than a batch takes, so they don't overflow
+U32 constexpr uringSqEntryC= 1024;
+U32 constexpr uringCqEntryC= 8192;
+// each receive takes a whole buffer, and they're handed back at the end of the batch
+U16 constexpr receiveBufferC= 512;
+U32 constexpr receiveBufferByteC= 4096;
 
 GenericUniquePointer::GenericUniquePointer(GenericUniquePointer &&other) noexcept:
 	o{other.o},
@@ -39,83 +51,667 @@ EpollReactor::EpollReactor(U8F const threadC): reactorThreads{
 	); }
 } {}
 
-bool PendingTimerCmp::operator()(
-	PendingTimer const &a,
-	PendingTimer const &b
+TimerWheel::TimerWheel():
+	epoch{std::chrono::steady_clock::now()},
+	timerFd{reactorBackend == ReactorBackend::epoll ? timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK) : -1}
+{
+	PERROR_ASSERT(-1 != timerFd || reactorBackend != ReactorBackend::epoll);
+	std::fill(std::begin(slotHeads), std::end(slotHeads), noTimerI);
+}
+
+UringThread::UringThread():
+	ring{uringSqEntryC, uringCqEntryC},
+	receiveBuffers{ring, 0, receiveBufferC, receiveBufferByteC}
+{}
+
+static U64 getUserData(U32 const id, CompletionKind const kind) {
+	return U64{id} << 8 | static_cast<U8>(kind);
+}
+
+// the first tick at or after $time
+static U64 getTick(TimerWheel const &wheel, std::chrono::steady_clock::time_point const time) {
+	return time <= wheel.epoch ? 0 : static_cast<U64>(
+		std::chrono::ceil<TimerWheelTick>(time - wheel.epoch).count()
+	);
+}
+// replaces the uring backend's timeout entry with one for $spec, or just
+// removes it if $spec is null. the old one's completion is ignored, whether it's
+// removed or it went off before the removal was submitted
+static void armTimeout(UringThread &uring, timespec const *const spec) {
+	if(uring.isTimeoutArmed) {
+		auto &sqe= getSqe(uring.ring);
+		sqe.opcode= IORING_OP_TIMEOUT_REMOVE;
+		sqe.addr= getUserData(uring.timeoutGeneration, CompletionKind::timeout);
+	}
+	uring.isTimeoutArmed= spec;
+	if(!spec)
+		return;
+	// it's read when it's submitted
+	uring.timeout.tv_sec= spec->tv_sec;
+	uring.timeout.tv_nsec= spec->tv_nsec;
+	auto &sqe= getSqe(uring.ring);
+	sqe.opcode= IORING_OP_TIMEOUT;
+	sqe.addr= reinterpret_cast<U64>(&uring.timeout);
+	sqe.len= 1;
+	sqe.timeout_flags= IORING_TIMEOUT_ABS;
+	sqe.user_data= getUserData(++uring.timeoutGeneration, CompletionKind::timeout);
+}
+// the thread wakes for the tick through the wheel's timerfd, or with the uring
+// backend, a timeout entry. both, and steady_clock, use CLOCK_MONOTONIC
+static void armTimer(EpollThread &thread, U64 const tick) {
+	auto &wheel= thread.timerWheel;
+	itimerspec spec{};
+	if(TimerWheel::noTick != tick) {
+		auto const sinceEpoch= (wheel.epoch + TimerWheelTick{tick}).time_since_epoch();
+		auto const seconds= std::chrono::floor<std::chrono::seconds>(sinceEpoch);
+		spec.it_value.tv_sec= seconds.count();
+		spec.it_value.tv_nsec= std::chrono::nanoseconds{sinceEpoch - seconds}.count();
+		// all zeroes would disarm the timer
+		if(0 == spec.it_value.tv_sec && 0 == spec.it_value.tv_nsec)
+			spec.it_value.tv_nsec= 1;
+	}
+	if constexpr(reactorBackend == ReactorBackend::uring)
+		armTimeout(*thread.uring, TimerWheel::noTick != tick ? &spec.it_value : nullptr);
+	else
+		PERROR_ASSERT(0 == timerfd_settime(wheel.timerFd, TFD_TIMER_ABSTIME, &spec, nullptr));
+	wheel.armedTick= tick;
+}
+// arms the timer for the next occupied slot
+// that slot's timers may all be a revolution or more away, in which case the
+// thread wakes up early and just arms it again
+static void armTimerForNextSlot(EpollThread &thread) {
+	auto &wheel= thread.timerWheel;
+	U32 constexpr wordC= TimerWheel::slotC / 64;
+	U32F const startSlotI= (wheel.currentTick + 1) % TimerWheel::slotC;
+	U64 nextTick= TimerWheel::noTick;
+	// the start word is visited twice: first for the slots after the start,
+	// and last for the slots before it
+	for(U32F wordII=0; wordII<=wordC; ++wordII) {
+		U32F const wordI= (startSlotI / 64 + wordII) % wordC;
+		U64 word= wheel.occupiedSlots[wordI];
+		if(0 == wordII)
+			word&= ~U64{0} << startSlotI % 64;
+		if(0 == word)
+			continue;
+		U32F const slotI= wordI * 64 + __builtin_ctzll(word);
+		nextTick= wheel.currentTick + 1 +
+			(slotI + TimerWheel::slotC - startSlotI) % TimerWheel::slotC;
+		break;
+	}
+	if(nextTick != wheel.armedTick)
+		armTimer(thread, nextTick);
+}
+static void linkTimer(EpollThread &thread, SmallReactionI const i) {
+	auto &wheel= thread.timerWheel;
+	auto &timer= thread.timerReactionTable[i];
+	// a timer that's already due goes in the next slot to be run
+	timer.expiryTick= std::max(getTick(wheel, timer.time), wheel.currentTick + 1);
+	U32F const slotI= timer.expiryTick % TimerWheel::slotC;
+	timer.prevI= noTimerI;
+	timer.nextI= wheel.slotHeads[slotI];
+	if(noTimerI != timer.nextI)
+		thread.timerReactionTable[timer.nextI].prevI= i;
+	wheel.slotHeads[slotI]= i;
+	wheel.occupiedSlots[slotI / 64]|= U64{1} << slotI % 64;
+	timer.linked= true;
+}
+static void unlinkTimer(EpollThread &thread, SmallReactionI const i) {
+	auto &wheel= thread.timerWheel;
+	auto &timer= thread.timerReactionTable[i];
+	U32F const slotI= timer.expiryTick % TimerWheel::slotC;
+	if(noTimerI == timer.prevI)
+		wheel.slotHeads[slotI]= timer.nextI;
+	else
+		thread.timerReactionTable[timer.prevI].nextI= timer.nextI;
+	if(noTimerI != timer.nextI)
+		thread.timerReactionTable[timer.nextI].prevI= timer.prevI;
+	if(noTimerI == wheel.slotHeads[slotI])
+		wheel.occupiedSlots[slotI / 64]&= ~(U64{1} << slotI % 64);
+	if(wheel.walkNextI == i)
+		wheel.walkNextI= timer.nextI;
+	timer.linked= false;
+}
+// links the timer and, if it's now the earliest, makes sure the thread wakes up for it
+static void scheduleTimer(EpollThread &thread, SmallReactionI const i) {
+	linkTimer(thread, i);
+	auto const expiryTick= thread.timerReactionTable[i].expiryTick;
+	// if the thread's epoll_wait is blocked, re-arming wakes it at the new time
+	if(expiryTick < thread.timerWheel.armedTick)
+		armTimer(thread, expiryTick);
+}
+static void destroyTimer(EpollThread &thread, SmallReactionI const i) {
+	thread.timerWheel.timerIsById.erase(thread.timerReactionTable[i].id);
+	destroy(thread.timerReactionTable, i);
+}
+static void runExpiredTimers(EpollThread &thread, ReactionExecutionInfo const execInfo) {
+	auto &wheel= thread.timerWheel;
+	auto &table= thread.timerReactionTable;
+	U64 const nowTick= std::chrono::floor<TimerWheelTick>(
+		std::chrono::steady_clock::now() - wheel.epoch
+	).count();
+	// if we've fallen more than a revolution behind, one pass over every slot
+	// still finds every due timer
+	U64 const lastTick= std::min<U64>(nowTick, wheel.currentTick + TimerWheel::slotC);
+	for(U64 tick=wheel.currentTick+1; tick<=lastTick; ++tick) {
+		wheel.currentTick= tick;
+		U32F const slotI= tick % TimerWheel::slotC;
+		wheel.walkNextI= noTimerI;
+		for(SmallReactionI i=wheel.slotHeads[slotI]; noTimerI != i; i= wheel.walkNextI) {
+			// reactions can add timers, which may grow (and so move) the table
+			wheel.walkNextI= table[i].nextI;
+			if(nowTick < table[i].expiryTick)
+				continue;
+			unlinkTimer(thread, i);
+			// periodic timers are linked again before their reaction runs, so
+			// that it can cancel or reschedule them like any other timer
+			if(std::chrono::steady_clock::duration::zero() != table[i].interval) {
+				table[i].time+= table[i].interval;
+				linkTimer(thread, i);
+			}
+			wheel.runningI= i;
+			wheel.runningCancelled= false;
+			table[i].func(table[i].data.o, execInfo);
+			wheel.runningI= noTimerI;
+			// one-shot timers are done unless their reaction rescheduled them
+			if(wheel.runningCancelled || !table[i].linked)
+				destroyTimer(thread, i);
+		}
+	}
+	wheel.currentTick= std::max(wheel.currentTick, nowTick);
+	armTimerForNextSlot(thread);
+}
+
+bool isThisThread(EpollThread const &thread) {
+	return std::this_thread::get_id() == thread.o.o.get_id();
+}
+static void wakeThread(EpollThread &thread) {
+	U64 const eventFdBuf= 1;
+	static_assert(8 == sizeof eventFdBuf);
+	PERROR_ASSERT(8 == write(thread.commandEventFd, &eventFdBuf, sizeof eventFdBuf));
+}
+// the commands form a stack, which is lock-free to push onto
+static void pushCommand(EpollThread &thread, std::unique_ptr<ThreadCommand> command_) {
+	auto *const command= command_.release();
+	command->next= thread.commands.load(std::memory_order_relaxed);
+	while(!thread.commands.compare_exchange_weak(
+		command->next,
+		command,
+		std::memory_order_release,
+		std::memory_order_relaxed
+	));
+}
+
+// stops the rest of this thread's current batch of events, including the
+// running reaction's own event, from referring to the reaction
+static void forgetBatchEvents(EpollThread &thread, FdReaction const &reaction) {
+	for(U32F i=thread.batchEventI; i<thread.batchEventC; ++i)
+		if(&reaction == thread.batchEvents[i].data.ptr)
+			thread.batchEvents[i].data.ptr= nullptr;
+}
+// must run on $thread
+static void adoptFdReaction(EpollThread &thread, std::unique_ptr<FdReaction> reaction) {
+	emplace(thread.fdReactionTable, [&reaction](auto const &create, auto const allocI) {
+		reaction->tableI= allocI;
+		create(std::move(reaction));
+	});
+}
+static CompletionKind getCompletionKind(FdOperation const operation) {
+	switch(operation) {
+	case FdOperation::poll:
+		return CompletionKind::poll;
+	case FdOperation::accept:
+		return CompletionKind::accept;
+	case FdOperation::receive:
+		return CompletionKind::receive;
+	}
+	UNIMPLEMENTED;
+}
+// submits the multishot operation that the uring backend waits on $reaction's FD with
+static void submitFdOperation(EpollThread &thread, FdReaction const &reaction) {
+	auto &uring= *thread.uring;
+	auto &sqe= getSqe(uring.ring);
+	sqe.fd= reaction.fd;
+	sqe.user_data= getUserData(reaction.id, getCompletionKind(reaction.operation));
+	switch(reaction.operation) {
+	case FdOperation::poll:
+		sqe.opcode= IORING_OP_POLL_ADD;
+		// it reports each time the FD becomes ready, so it's edge-triggered whether or not it's asked to be
+		sqe.poll32_events= reaction.events & ~U32{EPOLLET};
+		sqe.len= IORING_POLL_ADD_MULTI;
+		break;
+	case FdOperation::accept:
+		sqe.opcode= IORING_OP_ACCEPT;
+		sqe.ioprio= IORING_ACCEPT_MULTISHOT;
+		sqe.accept_flags= SOCK_NONBLOCK;
+		break;
+	case FdOperation::receive:
+		sqe.opcode= IORING_OP_RECV;
+		sqe.ioprio= IORING_RECV_MULTISHOT;
+		sqe.flags= IOSQE_BUFFER_SELECT;
+		sqe.buf_group= uring.receiveBuffers.groupId;
+		break;
+	}
+}
+// registers $reaction's FD with $thread's epoll instance, or submits what the uring backend waits for on it
+static void registerFd(EpollThread &thread, FdReaction &reaction) {
+	if constexpr(reactorBackend == ReactorBackend::uring) {
+		thread.uring->fdReactionsById.emplace(reaction.id, &reaction);
+		submitFdOperation(thread, reaction);
+		if(FdOperation::receive == reaction.operation && reaction.events & EPOLLOUT) {
+			auto &sqe= getSqe(thread.uring->ring);
+			sqe.opcode= IORING_OP_POLL_ADD;
+			sqe.fd= reaction.fd;
+			sqe.poll32_events= EPOLLOUT;
+			sqe.user_data= getUserData(reaction.id, CompletionKind::writable);
+		}
+		return;
+	}
+	epoll_event event;
+	event.events= reaction.events;
+	event.data.ptr= &reaction;
+	PERROR_ASSERT(0 == epoll_ctl(thread.epollFd, EPOLL_CTL_ADD, reaction.fd, &event));
+}
+// registers $fd with $thread's epoll instance, adding $reaction to the thread's
+// table first, or asking the thread to
+static ReactionHandle addFdReactionToThread(
+	EpollThread &thread,
+	signed const fd,
+	U32 const events,
+	std::unique_ptr<FdReaction> reaction
 ) {
-	return a.time < b.time;
+	auto &reactionRef= *reaction;
+	reaction->fd= fd;
+	reaction->events= events;
+	U32 const id= reaction->id= thread.nextFdReactionId++;
+	++thread.load.fdReactionC;
+	bool const isForeign= !isThisThread(thread);
+	// the command is pushed before the FD is registered, so the thread always
+	// adopts the reaction before it gets an event for it
+	if(isForeign)
+		pushCommand(thread, std::unique_ptr<ThreadCommand>{new ThreadCommand{
+			ThreadCommand::Type::adoptFdReaction,
+			nullptr,
+			std::move(reaction),
+			{}, {}, {}, {}, {}, {}
+		}});
+	else
+		adoptFdReaction(thread, std::move(reaction));
+	// only the uring backend's thread can submit to its ring, so it registers the FD when it adopts the reaction
+	if(reactorBackend == ReactorBackend::epoll || !isForeign)
+		registerFd(thread, reactionRef);
+	if(isForeign)
+		wakeThread(thread);
+	return {&reactionRef, thread.i, id};
+}
+
+// must run on $thread
+static void addTimerReactionToThread(
+	EpollThread &thread,
+	U32 const id,
+	std::chrono::steady_clock::time_point const time,
+	std::chrono::steady_clock::duration const interval,
+	TimerReaction &&reaction
+) {
+	auto const i= emplace(
+		thread.timerReactionTable,
+		[&reaction](auto const &cons, auto const i) {
+			cons(std::move(reaction));
+			return i;
+		}
+	);
+	auto &timer= thread.timerReactionTable[i];
+	timer.time= time;
+	timer.interval= interval;
+	timer.id= id;
+	thread.timerWheel.timerIsById.emplace(id, i);
+	scheduleTimer(thread, i);
+}
+// must run on $thread
+// returns noTimerI if the timer is already gone
+static SmallReactionI findTimer(EpollThread const &thread, U32 const id) {
+	auto const &wheel= thread.timerWheel;
+	auto const it= wheel.timerIsById.find(id);
+	if(end(wheel.timerIsById) == it)
+		return noTimerI;
+	if(wheel.runningI == it->second && wheel.runningCancelled)
+		return noTimerI;
+	return it->second;
+}
+// must run on $thread
+static void cancelTimerOnThisThread(EpollThread &thread, U32 const id) {
+	auto const i= findTimer(thread, id);
+	if(noTimerI == i)
+		return;
+	if(thread.timerReactionTable[i].linked)
+		unlinkTimer(thread, i);
+	// the running reaction's data is still in use, so runExpiredTimers destroys it afterwards
+	if(thread.timerWheel.runningI == i)
+		thread.timerWheel.runningCancelled= true;
+	else
+		destroyTimer(thread, i);
+}
+// must run on $thread
+static void rescheduleTimerOnThisThread(
+	EpollThread &thread,
+	U32 const id,
+	std::chrono::steady_clock::time_point const time
+) {
+	auto const i= findTimer(thread, id);
+	if(noTimerI == i)
+		return;
+	auto &timer= thread.timerReactionTable[i];
+	if(timer.linked)
+		unlinkTimer(thread, i);
+	timer.time= time;
+	scheduleTimer(thread, i);
+}
+
+static void runCommands(EpollThread &thread) {
+	// the stack has the most recently pushed command on top
+	ThreadCommand *reversed= nullptr;
+	for(auto *command=thread.commands.exchange(nullptr, std::memory_order_acquire); command; ) {
+		auto *const next= command->next;
+		command->next= reversed;
+		reversed= command;
+		command= next;
+	}
+	while(reversed) {
+		std::unique_ptr<ThreadCommand> const command{reversed};
+		reversed= command->next;
+		switch(command->type) {
+		case ThreadCommand::Type::adoptFdReaction: {
+				auto &reaction= *command->fdReaction;
+				adoptFdReaction(thread, std::move(command->fdReaction));
+				if constexpr(reactorBackend == ReactorBackend::uring)
+					registerFd(thread, reaction);
+				break;
+			}
+		case ThreadCommand::Type::addTimer:
+			addTimerReactionToThread(
+				thread,
+				command->timerId,
+				command->time,
+				command->interval,
+				std::move(*command->timerReaction)
+			);
+			break;
+		case ThreadCommand::Type::cancelTimer:
+			cancelTimerOnThisThread(thread, command->timerId);
+			break;
+		case ThreadCommand::Type::rescheduleTimer:
+			rescheduleTimerOnThisThread(thread, command->timerId, command->time);
+			break;
+		case ThreadCommand::Type::notifyFdReaction:
+			thread.uring->notifications.emplace_back(command->fdReactionId, command->events);
+			break;
+		}
+	}
+}
+
+// publishes the thread's load figures, and starts a new window
+static void endLoadWindow(EpollThread &thread) {
+	auto &load= thread.load;
+	double const windowSeconds= std::chrono::duration<double>{loadWindow}.count();
+	load.eventsPerSecond.store(load.windowEventC / windowSeconds, std::memory_order_relaxed);
+	load.reactionMicrosPerSecond.store(
+		std::chrono::duration<double, std::micro>{load.windowReactionTime}.count() / windowSeconds,
+		std::memory_order_relaxed
+	);
+	load.windowEventC= 0;
+	load.windowReactionTime= {};
+	foreach(thread.fdReactionTable, [](auto, auto, std::unique_ptr<FdReaction> &reaction) {
+		reaction->recentReactionTime= reaction->windowReactionTime;
+		reaction->windowReactionTime= {};
+	});
+}
+// the reactions that every thread has for itself
+static void addThreadReactions(EpollThread &thread) {
+	// this runs before thread.o is assigned, so it can't go through addFdReactionToThread
+	auto const &addOwnFdReaction= [&thread](signed const fd, FdReaction &&reaction_) -> FdReaction& {
+		auto reaction= std::make_unique<FdReaction>(std::move(reaction_));
+		auto &reactionRef= *reaction;
+		reaction->fd= fd;
+		reaction->events= EPOLLIN;
+		reaction->id= thread.nextFdReactionId++;
+		++thread.load.fdReactionC;
+		adoptFdReaction(thread, std::move(reaction));
+		// the uring backend's timer reaction is run for the timeout's completions instead
+		if(-1 != fd)
+			registerFd(thread, reactionRef);
+		return reactionRef;
+	};
+	auto &timerReaction= addOwnFdReaction(thread.timerWheel.timerFd, {
+		*[](void *data, U32 events, ReactionExecutionInfo const execInfo) {
+			auto &thread= getThisThread(execInfo);
+			if constexpr(reactorBackend == ReactorBackend::epoll) {
+				U64 expirationC;
+				// this fails with EAGAIN if the timer was re-armed after it went off
+				signed const readRet= read(thread.timerWheel.timerFd, &expirationC, sizeof expirationC);
+				PERROR_ASSERT(sizeof expirationC == readRet || EAGAIN == errno);
+			}
+			runExpiredTimers(thread, execInfo);
+		},
+		{Tag::notDeleted, nullptr}
+	});
+	if constexpr(reactorBackend == ReactorBackend::uring)
+		thread.uring->timerReaction= &timerReaction;
+	// the commands themselves are run after every epoll_wait
+	addOwnFdReaction(thread.commandEventFd, {
+		*[](void *data, U32 events, ReactionExecutionInfo const execInfo) {
+			U64 eventFdBuf;
+			PERROR_ASSERT(0 <= read(getThisThread(execInfo).commandEventFd, &eventFdBuf, sizeof eventFdBuf));
+		},
+		{Tag::notDeleted, nullptr}
+	});
+	addTimerReactionToThread(
+		thread,
+		thread.timerWheel.nextTimerId++,
+		std::chrono::steady_clock::now() + loadWindow,
+		loadWindow,
+		{
+			*[](void *data, ReactionExecutionInfo const execInfo) {
+				endLoadWindow(getThisThread(execInfo));
+			},
+			{Tag::notDeleted, nullptr}
+		}
+	);
+}
+
+// runs the reactions for a batch of events, then the work that they deferred to the end of it
+static void runBatch(
+	EpollThread &thread,
+	epoll_event *const events,
+	U32 const eventC,
+	ReactionExecutionInfo const execInfo
+) {
+	thread.batchEvents= events;
+	thread.batchEventC= eventC;
+	auto const batchStart= std::chrono::steady_clock::now();
+	auto reactionStart= batchStart;
+	for(U32F i=0; i<eventC; ++i) {
+		thread.batchEventI= i;
+		auto *const reaction= static_cast<FdReaction*>(events[i].data.ptr);
+		// the reaction went away earlier in the batch
+		if(!reaction)
+			continue;
+		if constexpr(reactorBackend == ReactorBackend::uring)
+			thread.uring->completion= thread.uring->batchCompletions[i];
+		reaction->func(reaction->data.o, static_cast<U32>(events[i].events), execInfo);
+		auto const reactionEnd= std::chrono::steady_clock::now();
+		// unless the reaction removed itself
+		if(events[i].data.ptr)
+			reaction->windowReactionTime+= reactionEnd - reactionStart;
+		reactionStart= reactionEnd;
+	}
+	thread.batchEvents= nullptr;
+	thread.batchEventC= 0;
+	if constexpr(reactorBackend == ReactorBackend::uring) {
+		thread.uring->completion= {};
+		// what was received into them is handled, or copied to the sockets' rings
+		for(auto const &completion : thread.uring->batchCompletions)
+			if(completion.hasBuffer)
+				recycleBuffer(thread.uring->receiveBuffers, completion.bufferI);
+	}
+	// deferred work can defer more, which is run in this same loop
+	auto &work= thread.endOfBatchWork;
+	for(U32F i=0; i<work.size(); ++i) {
+		auto const thisWork= work[i];
+		thisWork.func(thisWork.data);
+	}
+	work.clear();
+	thread.load.windowEventC+= eventC;
+	thread.load.windowReactionTime+= std::chrono::steady_clock::now() - batchStart;
 }
 
 static void executeEpollEvents(ReactionExecutionInfo const execInfo) {
 	auto &epollThread= execInfo.thisReactor.reactorThreads[execInfo.thisThreadI];
+	addThreadReactions(epollThread);
 	for(;;) {
 		epoll_event events[maxEventC];
-		auto &timers= epollThread.pendingTimers;
-		auto const timeout= [&epollThread,&timers]{
-			std::lock_guard g{epollThread.reactionTableMutex};
-			return timers.empty() ? -1 :
-				std::chrono::duration_cast<std::chrono::milliseconds>(
-					timers.top().time - std::chrono::steady_clock::now()
-				).count();
-		}();
-		signed const epollRet= epoll_wait(
-			epollThread.epollFd,
-			events,
-			maxEventC,
-			timeout
-		);
-		auto const &checkTimers= [&epollThread, &timers, execInfo]{
-			auto const now= std::chrono::ceil<std::chrono::milliseconds>(std::chrono::steady_clock::now());
-			for(; !timers.empty() && std::chrono::floor<std::chrono::milliseconds>(timers.top().time) <= now; ) {
-				auto timer= timers.top();
-				timers.pop();
-				auto const &reaction= epollThread.timerReactionTable[timer.indexInTable];
-				reaction.func(reaction.data.o, execInfo);
-				timer.time += timer.interval;
-				timers.push(timer);
-			}
-		};
-		std::lock_guard g{epollThread.reactionTableMutex};
-		checkTimers();
+		// timers wake the thread through the wheel's timerfd, so there's no timeout
+		signed const epollRet= epoll_wait(epollThread.epollFd, events, maxEventC, -1);
 		if(epollRet == -1 && errno == EINTR)
 			continue;
 		PERROR_ASSERT(0 <= epollRet);
-		for(U32F i=0; i<static_cast<U32F>(epollRet); ++i) {
-			auto const &reaction= epollThread.fdReactionTable[events[i].data.u32];
-			reaction.func(reaction.data.o, static_cast<U32>(events[i].events), execInfo);
+		runCommands(epollThread);
+		runBatch(epollThread, events, epollRet, execInfo);
+	}
+}
+
+static void addToBatch(UringThread &uring, FdReaction &reaction, U32 const events, UringCompletion const &completion) {
+	epoll_event event;
+	event.events= events;
+	event.data.ptr= &reaction;
+	uring.batchEvents.push_back(event);
+	uring.batchCompletions.push_back(completion);
+}
+// adds an event for the completion's reaction to the batch, with what the
+// reaction can take from it, and submits the operation again if it stopped
+static void addCompletionToBatch(EpollThread &thread, io_uring_cqe const &cqe) {
+	auto &uring= *thread.uring;
+	auto const kind= static_cast<CompletionKind>(cqe.user_data & 0xff);
+	U32 const id= cqe.user_data >> 8;
+	UringCompletion const completion{
+		kind,
+		cqe.res,
+		0 != (cqe.flags & IORING_CQE_F_BUFFER),
+		static_cast<U16>(cqe.flags >> IORING_CQE_BUFFER_SHIFT)
+	};
+	bool const isStopped= !(cqe.flags & IORING_CQE_F_MORE);
+	if(CompletionKind::none == kind)
+		return;
+	if(CompletionKind::timeout == kind) {
+		// otherwise it's been replaced, or removed
+		if(id == uring.timeoutGeneration && -ETIME == cqe.res) {
+			uring.isTimeoutArmed= false;
+			addToBatch(uring, *uring.timerReaction, EPOLLIN, {});
+		}
+		return;
+	}
+	auto const it= uring.fdReactionsById.find(id);
+	// the reaction's gone, and its operations are being cancelled
+	if(end(uring.fdReactionsById) == it) {
+		if(completion.hasBuffer)
+			recycleBuffer(uring.receiveBuffers, completion.bufferI);
+		if(CompletionKind::send == kind)
+			uring.sendKeepAlives.erase(id);
+		return;
+	}
+	auto &reaction= *it->second;
+	U32 events= 0;
+	switch(kind) {
+	case CompletionKind::poll:
+		if(0 <= cqe.res && isStopped)
+			submitFdOperation(thread, reaction);
+		[[fallthrough]];
+	case CompletionKind::writable:
+		if(0 <= cqe.res)
+			events= cqe.res;
+		break;
+	case CompletionKind::accept:
+		if(0 <= cqe.res)
+			events= EPOLLIN;
+		if(isStopped)
+			submitFdOperation(thread, reaction);
+		break;
+	case CompletionKind::receive:
+		if(0 < cqe.res)
+			events= EPOLLIN;
+		else if(0 == cqe.res)
+			events= EPOLLIN | EPOLLRDHUP;
+		// which is when every buffer's waiting to be handled
+		else if(-ENOBUFS != cqe.res)
+			events= EPOLLERR | EPOLLHUP;
+		if(isStopped && (0 < cqe.res || -ENOBUFS == cqe.res))
+			submitFdOperation(thread, reaction);
+		break;
+	case CompletionKind::send:
+		events= EPOLLOUT;
+		break;
+	case CompletionKind::none:
+	case CompletionKind::timeout:
+		break;
+	}
+	if(events)
+		addToBatch(uring, reaction, events, completion);
+	else if(completion.hasBuffer)
+		recycleBuffer(uring.receiveBuffers, completion.bufferI);
+}
+
+static void executeUringCompletions(ReactionExecutionInfo const execInfo) {
+	auto &thread= getThisThread(execInfo);
+	auto &uring= *thread.uring;
+	enableUring(uring.ring);
+	addThreadReactions(thread);
+	for(;;) {
+		// whatever the last batch submitted goes with the wait for the next,
+		// which the wheel's timeout entry ends in time for the next timer
+		submitUring(uring.ring, 1);
+		runCommands(thread);
+		uring.batchEvents.clear();
+		uring.batchCompletions.clear();
+		for(auto const &[id, events] : uring.notifications) {
+			auto const it= uring.fdReactionsById.find(id);
+			if(end(uring.fdReactionsById) != it)
+				addToBatch(uring, *it->second, events, {});
 		}
-		checkTimers();
+		uring.notifications.clear();
+		io_uring_cqe cqes[maxEventC];
+		U32 const cqeC= takeCompletions(uring.ring, cqes, maxEventC);
+		for(U32F i=0; i<cqeC; ++i)
+			addCompletionToBatch(thread, cqes[i]);
+		runBatch(thread, uring.batchEvents.data(), uring.batchEvents.size(), execInfo);
 	}
 }
+
 EpollThread::EpollThread(EpollReactor &reactor, U32L const i):
 	i{i},
-	epollFd{epoll_create(epollCreateHint)},
-	wakeupForNewTimerFd{[]{
+	epollFd{reactorBackend == ReactorBackend::epoll ? epoll_create(epollCreateHint) : -1},
+	commandEventFd{[]{
 		signed const eventFdRet= eventfd(0, EFD_NONBLOCK);
 		PERROR_ASSERT(-1 != eventFdRet);
 		return eventFdRet;
 	}()},
 	fdReactionTable{5},
 	timerReactionTable{5},
-	o{executeEpollEvents, ReactionExecutionInfo{reactor, i}}
-{
-	addFdReaction(reactor, wakeupForNewTimerFd, EPOLLIN, {
-		*[](void *data, U32 events, ReactionExecutionInfo) {
-//			std::cout << "woken up for new timer\n";
-			char eventFdBuf[8];
-			PERROR_ASSERT(0 <= read(*static_cast<signed*>(data), &eventFdBuf, sizeof eventFdBuf));
-		},
-		{Tag::notDeleted, &wakeupForNewTimerFd}
-	});
+	uring{reactorBackend == ReactorBackend::uring ? std::make_unique<UringThread>() : nullptr},
+	o{
+		reactorBackend == ReactorBackend::uring ? executeUringCompletions : executeEpollEvents,
+		ReactionExecutionInfo{reactor, i}
+	}
+{}
+
+U32 deferToEndOfBatch(EpollThread &thisThread, DeferredFunc &func, void *const data) {
+	ASSERT(isThisThread(thisThread));
+	thisThread.endOfBatchWork.push_back({std::ref(func), data});
+	return thisThread.endOfBatchWork.size() - 1;
+}
+static void noopDeferredFunc(void*) {}
+void cancelEndOfBatchWork(EpollThread &thisThread, U32 const workI) {
+	thisThread.endOfBatchWork[workI].func= std::ref(noopDeferredFunc);
 }
 
-struct AddReactionLock {
-	std::optional<std::lock_guard<std::mutex>> lock;
-	U32 targetThreadI;
-};
-// don't acquire the lock if this thread's epoll executor already acquired it
-// (in the case where we want to add a reaction to this thread's executor)
-AddReactionLock lockForAddReaction(EpollReactor &reactor) {
+static U8F takeRoundRobinI(EpollReactor &reactor) {
 	U8F nextRoundRobinI;
 	for(;;) {
 		nextRoundRobinI= reactor.nextRoundRobinI.load();
@@ -126,69 +722,265 @@ AddReactionLock lockForAddReaction(EpollReactor &reactor) {
 			std::memory_order_relaxed,
 			std::memory_order_relaxed
 		))
-			break;
+			return nextRoundRobinI;
 	}
-	auto &targetThread= reactor.reactorThreads[nextRoundRobinI];
-	return {
-		std::this_thread::get_id() == targetThread.o.o.get_id()
-			? std::nullopt
-			: std::optional<std::lock_guard<std::mutex>>{std::in_place, targetThread.reactionTableMutex},
-		nextRoundRobinI
+}
+U32 getLeastLoadedThreadI(EpollReactor const &reactor) {
+	// reaction time is compared in whole milliseconds per second, so that
+	// threads which are all but idle are told apart by how many FDs they have
+	auto const &getLoadKey= [&reactor](U32 const i) {
+		auto const &load= reactor.reactorThreads[i].load;
+		return std::pair{
+			load.reactionMicrosPerSecond.load(std::memory_order_relaxed) / 1000,
+			load.fdReactionC.load(std::memory_order_relaxed)
+		};
 	};
+	U32 ret= 0;
+	for(U32 i=1; i<reactor.reactorThreads.size; ++i)
+		if(getLoadKey(i) < getLoadKey(ret))
+			ret= i;
+	return ret;
 }
 
 ReactionHandle addFdReaction(
 	EpollReactor &reactor,
+	U32 const targetThreadI,
 	signed const fd,
 	U32 const events,
 	FdReaction &&reaction
 ) {
-//	std::cout << "start addFdReaction\n";
-	auto const lock= lockForAddReaction(reactor);
-	auto &target= reactor.reactorThreads[lock.targetThreadI];
-	auto const allocI= emplace(target.fdReactionTable,
-		[&reaction, &target, events, fd]
-		(auto const &create, auto const allocI) {
-			create(std::move(reaction));
-			epoll_event event;
-			event.events= events;
-			event.data.u32= allocI;
-			epoll_ctl(target.epollFd, EPOLL_CTL_ADD, fd, &event);
-			return allocI;
-		}
+	return addFdReactionToThread(
+		reactor.reactorThreads[targetThreadI],
+		fd,
+		events,
+		std::make_unique<FdReaction>(std::move(reaction))
 	);
-	return {static_cast<U32>(allocI), lock.targetThreadI};
-//	std::cout << "end addFdReaction\n";
+}
+ReactionHandle addFdReaction(
+	EpollReactor &reactor,
+	signed const fd,
+	U32 const events,
+	FdReaction &&reaction
+) {
+	return addFdReaction(reactor, getLeastLoadedThreadI(reactor), fd, events, std::move(reaction));
+}
+
+// the uring backend's, which keep the FD open, and the buffers that sends point at in use, until they're done
+static void cancelFdOperations(EpollThread &thread, FdReaction const &reaction) {
+	auto &uring= *thread.uring;
+	uring.fdReactionsById.erase(reaction.id);
+	auto const &cancel= [&uring, &reaction](CompletionKind const kind) {
+		auto &sqe= getSqe(uring.ring);
+		sqe.opcode= IORING_OP_ASYNC_CANCEL;
+		sqe.addr= getUserData(reaction.id, kind);
+		sqe.cancel_flags= IORING_ASYNC_CANCEL_ALL;
+	};
+	cancel(getCompletionKind(reaction.operation));
+	if(FdOperation::receive == reaction.operation) {
+		cancel(CompletionKind::writable);
+		cancel(CompletionKind::send);
+	}
 }
 
-void removeReactionFromThisThread(EpollThread &thread, U32 const reactionI) {
-	destroy(thread.fdReactionTable, reactionI);
+void removeReactionFromThisThread(EpollThread &thread, FdReaction &reaction) {
+	ASSERT(thread.fdReactionTable[reaction.tableI].get() == &reaction);
+	if constexpr(reactorBackend == ReactorBackend::uring)
+		cancelFdOperations(thread, reaction);
+	forgetBatchEvents(thread, reaction);
+	--thread.load.fdReactionC;
+	destroy(thread.fdReactionTable, reaction.tableI);
 }
 
-void addTimerReaction(
+ReactionHandle migrateFdReactionFromThisThread(
+	ReactionExecutionInfo const execInfo,
+	FdReaction &reaction,
+	signed const fd,
+	U32 const events,
+	U32 const targetThreadI
+) {
+	ASSERT(reactorBackend == ReactorBackend::epoll);
+	ASSERT(targetThreadI != execInfo.thisThreadI);
+	auto &thisThread= getThisThread(execInfo);
+	auto &tableSlot= thisThread.fdReactionTable[reaction.tableI];
+	ASSERT(tableSlot.get() == &reaction);
+	PERROR_ASSERT(0 == epoll_ctl(thisThread.epollFd, EPOLL_CTL_DEL, fd, nullptr));
+	// events that were already ready are reported again by the target's epoll instance
+	forgetBatchEvents(thisThread, reaction);
+	auto movedReaction= std::move(tableSlot);
+	destroy(thisThread.fdReactionTable, reaction.tableI);
+	--thisThread.load.fdReactionC;
+	return addFdReactionToThread(
+		execInfo.thisReactor.reactorThreads[targetThreadI],
+		fd,
+		events,
+		std::move(movedReaction)
+	);
+}
+
+static TimerHandle addTimerReaction(
 	EpollReactor &reactor,
+	U32 const targetThreadI,
+	std::chrono::steady_clock::duration const delay,
 	std::chrono::steady_clock::duration const interval,
 	TimerReaction &&reaction
 ) {
-//	std::cout << "start addTimerReaction\n";
-	auto const &[lock, targetThreadI]= lockForAddReaction(reactor);
-	auto &targetThread= reactor.reactorThreads[targetThreadI];
-	auto const i= emplace(
-		targetThread.timerReactionTable,
-		[&reaction](auto const &cons, auto const i) {
-			cons(std::move(reaction));
-			return i;
-		}
+	auto &thread= reactor.reactorThreads[targetThreadI];
+	U32 const id= thread.timerWheel.nextTimerId++;
+	auto const time= std::chrono::steady_clock::now() + delay;
+	if(isThisThread(thread))
+		addTimerReactionToThread(thread, id, time, interval, std::move(reaction));
+	else {
+		pushCommand(thread, std::unique_ptr<ThreadCommand>{new ThreadCommand{
+			ThreadCommand::Type::addTimer,
+			nullptr,
+			{},
+			std::move(reaction),
+			interval,
+			id,
+			time,
+			{}, {}
+		}});
+		wakeThread(thread);
+	}
+	return {targetThreadI, id};
+}
+
+TimerHandle addTimerReaction(
+	EpollReactor &reactor,
+	U32 const targetThreadI,
+	std::chrono::steady_clock::duration const interval,
+	TimerReaction &&reaction
+) {
+	ASSERT(std::chrono::steady_clock::duration::zero() != interval);
+	return addTimerReaction(reactor, targetThreadI, interval, interval, std::move(reaction));
+}
+TimerHandle addTimerReaction(
+	EpollReactor &reactor,
+	std::chrono::steady_clock::duration const interval,
+	TimerReaction &&reaction
+) {
+	return addTimerReaction(reactor, takeRoundRobinI(reactor), interval, std::move(reaction));
+}
+
+TimerHandle addOneShotTimerReaction(
+	EpollReactor &reactor,
+	U32 const targetThreadI,
+	std::chrono::steady_clock::duration const delay,
+	TimerReaction &&reaction
+) {
+	return addTimerReaction(
+		reactor,
+		targetThreadI,
+		delay,
+		std::chrono::steady_clock::duration::zero(),
+		std::move(reaction)
 	);
-	targetThread.pendingTimers.push({
-		std::chrono::steady_clock::now() + interval,
-		interval,
-		static_cast<SmallReactionI>(i)
-	});
-	U64 const eventFdBuf= 1;
-	static_assert(8 == sizeof eventFdBuf);
-	PERROR_ASSERT(8 == write(targetThread.wakeupForNewTimerFd, &eventFdBuf, sizeof eventFdBuf));
-//	std::cout << "end addTimerReaction\n";
+}
+TimerHandle addOneShotTimerReaction(
+	EpollReactor &reactor,
+	std::chrono::steady_clock::duration const delay,
+	TimerReaction &&reaction
+) {
+	return addOneShotTimerReaction(reactor, takeRoundRobinI(reactor), delay, std::move(reaction));
+}
+
+void cancelTimer(EpollReactor &reactor, TimerHandle const handle) {
+	auto &thread= reactor.reactorThreads[handle.reactionThreadI];
+	if(isThisThread(thread)) {
+		cancelTimerOnThisThread(thread, handle.id);
+		return;
+	}
+	pushCommand(thread, std::unique_ptr<ThreadCommand>{new ThreadCommand{
+		ThreadCommand::Type::cancelTimer,
+		nullptr,
+		{}, {}, {},
+		handle.id,
+		{}, {}, {}
+	}});
+	wakeThread(thread);
+}
+
+void rescheduleTimer(
+	EpollReactor &reactor,
+	TimerHandle const handle,
+	std::chrono::steady_clock::duration const delay
+) {
+	auto &thread= reactor.reactorThreads[handle.reactionThreadI];
+	auto const time= std::chrono::steady_clock::now() + delay;
+	if(isThisThread(thread)) {
+		rescheduleTimerOnThisThread(thread, handle.id, time);
+		return;
+	}
+	pushCommand(thread, std::unique_ptr<ThreadCommand>{new ThreadCommand{
+		ThreadCommand::Type::rescheduleTimer,
+		nullptr,
+		{}, {}, {},
+		handle.id,
+		time,
+		{}, {}
+	}});
+	wakeThread(thread);
+}
+
+std::optional<StringView<U32>> takeReceivedBytes(EpollThread &thisThread) {
+	auto &uring= *thisThread.uring;
+	auto &completion= uring.completion;
+	if(CompletionKind::receive != completion.kind)
+		return std::nullopt;
+	completion.kind= CompletionKind::none;
+	if(!completion.hasBuffer)
+		return StringView<U32>{nullptr, U32{0}};
+	return StringView<U32>{
+		getBuffer(uring.receiveBuffers, completion.bufferI),
+		static_cast<U32>(completion.result)
+	};
+}
+
+signed takeAcceptedFd(EpollThread &thisThread) {
+	auto &completion= thisThread.uring->completion;
+	if(CompletionKind::accept != completion.kind)
+		return -1;
+	completion.kind= CompletionKind::none;
+	return completion.result;
+}
+
+std::optional<S32> takeSendResult(EpollThread &thisThread) {
+	auto &completion= thisThread.uring->completion;
+	if(CompletionKind::send != completion.kind)
+		return std::nullopt;
+	completion.kind= CompletionKind::none;
+	return completion.result;
+}
+
+void submitSend(EpollThread &thisThread, FdReaction &reaction, msghdr const &message) {
+	ASSERT(isThisThread(thisThread));
+	auto &sqe= getSqe(thisThread.uring->ring);
+	sqe.opcode= IORING_OP_SENDMSG;
+	sqe.fd= reaction.fd;
+	sqe.addr= reinterpret_cast<U64>(&message);
+	sqe.len= 1;
+	// if the peer has gone, its reaction finds out by receiving, rather than the process getting SIGPIPE
+	sqe.msg_flags= MSG_NOSIGNAL;
+	sqe.user_data= getUserData(reaction.id, CompletionKind::send);
+}
+
+void keepUntilSent(EpollThread &thisThread, U32 const reactionId, GenericUniquePointer o) {
+	ASSERT(isThisThread(thisThread));
+	thisThread.uring->sendKeepAlives.emplace(reactionId, std::move(o));
+}
+
+void notifyFdReaction(EpollReactor &reactor, ReactionHandle const handle, U32 const events) {
+	ASSERT(reactorBackend == ReactorBackend::uring);
+	auto &thread= reactor.reactorThreads[handle.reactionThreadI];
+	ASSERT(!isThisThread(thread));
+	pushCommand(thread, std::unique_ptr<ThreadCommand>{new ThreadCommand{
+		ThreadCommand::Type::notifyFdReaction,
+		nullptr,
+		{}, {}, {}, {}, {},
+		handle.reactionId,
+		events
+	}});
+	wakeThread(thread);
 }
 
 EpollThread &getThisThread(ReactionExecutionInfo const execInfo) {
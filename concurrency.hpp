@@ -1,15 +1,22 @@
 #pragma once
 #include<atomic> // std::atomic<U8F>
+#include<chrono> // std::chrono::steady_clock
 #include<condition_variable> // std::condition_variable
+#include<cstring> // std::memcpy
 #include<functional> // std::reference_wrapper
+#include<limits> // std::numeric_limits
+#include<memory> // std::unique_ptr
 #include<mutex> // std::mutex
+#include<optional> // std::optional
 #include<thread> // std::thread
-#include<queue> // std::queue
+#include<unordered_map> // std::unordered_map
 #include<utility> // std::make_index_sequence
 #include<vector> // std::vector
 #include<sys/epoll.h> // EPOLLIN
+#include<sys/socket.h> // msghdr
 #include"array.hpp"
 #include"common.hpp"
+#include"uring.hpp"
 
 struct JoiningThread {
 	std::thread o;
@@ -49,6 +56,53 @@ GenericUniquePointer::GenericUniquePointer(Tag::DefaultDeleted, O &o) noexcept:
 	}}
 {}
 
+// a value that one thread publishes and another reads the newest of, without
+// either ever waiting for the other. each thread has a copy of its own, which
+// it swaps for the one in between
+template<typename O>
+struct TripleBuffer {
+	O copies[3];
+	// the copy in between, with tripleBufferNewBit set if the reader hasn't had it yet
+	std::atomic<U8> middleI{1};
+	// the writer's
+	U8 backI= 0;
+	// the reader's
+	U8 frontI= 2;
+};
+U8 constexpr tripleBufferNewBit= 1 << 2;
+// the writer's copy, which it fills in before publishing it
+template<typename O>
+O &getBack(TripleBuffer<O> &buffer) {
+	return buffer.copies[buffer.backI];
+}
+// hands the writer's copy to the reader, and the writer gets the one in between
+// to fill in next, which the reader either had or skipped
+template<typename O>
+void publishBack(TripleBuffer<O> &buffer) {
+	buffer.backI= buffer.middleI.exchange(buffer.backI | tripleBufferNewBit, std::memory_order_acq_rel)
+		& ~tripleBufferNewBit;
+}
+// the newest copy published, which the reader has until it calls this again
+template<typename O>
+O const &takeFront(TripleBuffer<O> &buffer) {
+	if(buffer.middleI.load(std::memory_order_relaxed) & tripleBufferNewBit)
+		buffer.frontI= buffer.middleI.exchange(buffer.frontI, std::memory_order_acq_rel)
+			& ~tripleBufferNewBit;
+	return buffer.copies[buffer.frontI];
+}
+
+// which kernel interface the reactor threads wait on
+enum class ReactorBackend {
+	epoll,
+	// an io_uring for each thread. rather than being told when a socket is
+	// readable, a thread is handed what was received, and sends are submitted
+	// rather than made. whatever a batch of reactions asks for is submitted
+	// with the one syscall that waits for the next batch
+	// a stream socket stays on the thread it's added to
+	uring,
+};
+ReactorBackend constexpr reactorBackend= ReactorBackend::epoll;
+
 struct EpollReactor;
 struct EpollThread;
 struct ReactionExecutionInfo {
@@ -56,51 +110,207 @@ struct ReactionExecutionInfo {
 	U32 thisThreadI;
 };
 EpollThread &getThisThread(ReactionExecutionInfo);
+bool isThisThread(EpollThread const&);
 
 typedef void FdReactionFunc(void *data, U32 events, ReactionExecutionInfo);
+typedef U16L SmallReactionI;
+typedef U16F FastReactionI;
+// what the uring backend waits for on a reaction's FD. the epoll backend
+// waits for the FD to be ready, and leaves the reaction to do the rest
+enum class FdOperation: U8 {
+	// the FD being ready, which is reported like epoll would
+	poll,
+	// connections to a listening socket, each reported as EPOLLIN, see takeAcceptedFd
+	accept,
+	// bytes on a stream socket, each lot reported as EPOLLIN, see takeReceivedBytes
+	// with EPOLLOUT, the reaction is also told once when the socket is first writable
+	receive,
+};
 struct FdReaction {
 	std::reference_wrapper<FdReactionFunc> func;
 	GenericUniquePointer data;
+	// time spent running this reaction in the current load window, and in the last whole one
+	std::chrono::steady_clock::duration windowReactionTime{};
+	std::chrono::steady_clock::duration recentReactionTime{};
+	// where this is in its thread's fdReactionTable, once the thread has adopted it
+	FastReactionI tableI{};
+	FdOperation operation= FdOperation::poll;
+	// what the reaction was added with, for the uring backend to submit its operation with
+	signed fd= -1;
+	U32 events= 0;
+	// unique among the thread's FD reactions, the uring backend's completions carry it
+	U32 id= 0;
 };
 typedef void TimerReactionFunc(void *data, ReactionExecutionInfo);
+SmallReactionI constexpr noTimerI= std::numeric_limits<SmallReactionI>::max();
 struct TimerReaction {
 	std::reference_wrapper<TimerReactionFunc> func;
 	GenericUniquePointer data;
+	// the rest is the timer's place in its thread's timer wheel
+	std::chrono::steady_clock::time_point time;
+	// zero for one-shot timers
+	std::chrono::steady_clock::duration interval;
+	U64 expiryTick;
+	// distinguishes this timer from earlier ones that had the same table index
+	U32 id;
+	bool linked= false;
+	// neighbours in the wheel slot's list
+	SmallReactionI prevI= noTimerI;
+	SmallReactionI nextI= noTimerI;
 	TimerReaction(TimerReactionFunc &func, GenericUniquePointer data):
 		func{std::ref(func)},
 		data{std::move(data)}
 	{}
 };
-typedef U16L SmallReactionI;
-typedef U16F FastReactionI;
-struct PendingTimer {
-	std::chrono::steady_clock::time_point time;
+// timers go off to within one of these (100µs)
+typedef std::chrono::duration<S64, std::ratio<1, 10000>> TimerWheelTick;
+// hashed timing wheel: each timer is linked into the slot for the tick it
+// expires on, modulo the slot count
+// timers more than a revolution away stay in their slot until their tick comes round
+// insertion and removal are O(1), and a timerfd wakes the thread for the next occupied slot
+struct TimerWheel {
+	static U32 constexpr slotC= 1024;
+	std::chrono::steady_clock::time_point epoch;
+	// every tick up to and including this one has been run
+	U64 currentTick= 0;
+	// the tick that timerFd is set to go off at, or noTick if it's disarmed
+	static U64 constexpr noTick= std::numeric_limits<U64>::max();
+	U64 armedTick= noTick;
+	signed timerFd;
+	SmallReactionI slotHeads[slotC];
+	// one bit per slot, set if the slot has any timers
+	U64 occupiedSlots[slotC / 64]= {};
+	// ids are handed out by whichever thread adds the timer
+	std::atomic<U32> nextTimerId{0};
+	std::unordered_map<U32, SmallReactionI> timerIsById;
+	// these let reactions cancel or reschedule any timer, including the one
+	// that's running and the one that would be run after it
+	SmallReactionI runningI= noTimerI;
+	bool runningCancelled;
+	SmallReactionI walkNextI;
+	TimerWheel();
+};
+auto constexpr loadWindow= std::chrono::seconds{1};
+struct ThreadLoad {
+	// published at the end of each load window, for other threads to place reactions by
+	std::atomic<U32> eventsPerSecond{0};
+	std::atomic<U32> reactionMicrosPerSecond{0};
+	// kept up to date, so that a burst of new reactions is spread out before
+	// it shows up in the windowed figures
+	std::atomic<U32> fdReactionC{0};
+	// accumulated by the thread itself during the current window
+	U32 windowEventC= 0;
+	std::chrono::steady_clock::duration windowReactionTime{};
+};
+// something that another thread asked a reactor thread to do to its reaction
+// tables, which only it touches
+struct ThreadCommand {
+	enum class Type: U8 {
+		adoptFdReaction,
+		addTimer,
+		cancelTimer,
+		rescheduleTimer,
+		notifyFdReaction
+	} type;
+	ThreadCommand *next;
+	// adoptFdReaction
+	std::unique_ptr<FdReaction> fdReaction;
+	// addTimer
+	std::optional<TimerReaction> timerReaction;
 	std::chrono::steady_clock::duration interval;
-	SmallReactionI indexInTable;
+	// addTimer, cancelTimer and rescheduleTimer
+	U32 timerId;
+	// addTimer and rescheduleTimer
+	std::chrono::steady_clock::time_point time;
+	// notifyFdReaction
+	U32 fdReactionId;
+	U32 events;
+};
+typedef void DeferredFunc(void *data);
+struct DeferredWork {
+	std::reference_wrapper<DeferredFunc> func;
+	void *data;
+};
+// what a completion that the uring backend hands to a reaction is for, which
+// goes in the low byte of its user_data, under the reaction's id
+enum class CompletionKind: U8 {
+	// cancellations and such, which nothing waits for
+	none,
+	poll,
+	accept,
+	receive,
+	// the one-shot poll for a receiving socket's first writability
+	writable,
+	send,
+	// the timer wheel's, whose completions carry a generation rather than a reaction's id
+	timeout
 };
-struct PendingTimerCmp {
-	bool operator()(PendingTimer const&, PendingTimer const&);
+struct UringCompletion {
+	CompletionKind kind= CompletionKind::none;
+	// what the operation returned, a negative errno if it failed
+	S32 result;
+	// received into, if the operation took one of the thread's receive buffers
+	bool hasBuffer= false;
+	U16 bufferI;
+};
+// the uring backend's part of a reactor thread
+struct UringThread {
+	Uring ring;
+	UringBufferRing receiveBuffers;
+	// the thread's FD reactions, so that completions for the ones that are gone can be ignored
+	std::unordered_map<U32, FdReaction*> fdReactionsById;
+	// the wheel's deadline is a timeout entry, which is removed and replaced
+	// whenever the wheel is re-armed. completions of replaced ones are ignored
+	U32 timeoutGeneration= 0;
+	bool isTimeoutArmed= false;
+	__kernel_timespec timeout;
+	// run when the timeout goes off, it's in the thread's fdReactionTable like
+	// the epoll backend's timerfd reaction
+	FdReaction *timerReaction;
+	// what sends that were in flight when their sockets went still point at, by the
+	// ids of the sockets' reactions, until the sends complete
+	std::unordered_map<U32, GenericUniquePointer> sendKeepAlives;
+	// (reaction id, events) that other threads asked for, see notifyFdReaction
+	std::vector<std::pair<U32, U32>> notifications;
+	// the completions of the batch being dispatched, with one event for each
+	std::vector<epoll_event> batchEvents;
+	std::vector<UringCompletion> batchCompletions;
+	// the running reaction's, until it takes it
+	UringCompletion completion;
+	UringThread();
 };
 struct EpollReactor;
 struct EpollThread {
 	U32L i;
+	// -1 with the uring backend
 	signed epollFd;
-	signed wakeupForNewTimerFd;
-	HoleyArray<FdReaction, FastReactionI> fdReactionTable;
-	std::mutex reactionTableMutex;
+	// other threads push commands here, and write to commandEventFd to wake this one
+	// the thread runs them in the order they were pushed, after every epoll_wait
+	std::atomic<ThreadCommand*> commands{nullptr};
+	signed commandEventFd;
+	// the reactions are owned by the table, and epoll events point at them directly
+	BitmapHoleyArray<std::unique_ptr<FdReaction>, FastReactionI> fdReactionTable;
+	// handed out by whichever thread adds the reaction, like timer ids
+	std::atomic<U32> nextFdReactionId{1};
 	HoleyArray<TimerReaction, FastReactionI> timerReactionTable;
-	std::priority_queue<
-		PendingTimer,
-		std::vector<PendingTimer>,
-		PendingTimerCmp
-	> pendingTimers;
+	TimerWheel timerWheel;
+	ThreadLoad load;
+	// the batch of events being dispatched, so that reactions which go away
+	// can stop later events in the batch from being dispatched to them
+	epoll_event *batchEvents= nullptr;
+	U32 batchEventC= 0;
+	U32 batchEventI= 0;
+	// run once the batch's reactions are done, see deferToEndOfBatch
+	std::vector<DeferredWork> endOfBatchWork;
+	// null with the epoll backend
+	std::unique_ptr<UringThread> uring;
 	// this is last because it must be destroyed (by joining) before reactionTable and such
 	JoiningThread o;
 	EpollThread(EpollReactor &reactor, U32L i);
 };
 // each thread "epoll_wait"s on a different epoll instance's FD
 // epoll instances' event FD sets are disjoint, to improve cache locality
-// TODO: implement rebalancing FDs between threads
+// new FDs go to the least loaded thread, and can be migrated between threads afterwards
 struct EpollReactor {
 	std::atomic<U8F> nextRoundRobinI= 0;
 	std::mutex nextRoundRobinIMutex;
@@ -109,13 +319,145 @@ struct EpollReactor {
 	EpollReactor(U8F threadC);
 };
 struct ReactionHandle {
-	U32 epollReactionI;
+	// stays the same when the reaction moves between threads
+	FdReaction *reaction;
 	U32 reactionThreadI;
+	// changes when it moves, see notifyFdReaction
+	U32 reactionId;
 };
+// none of these functions wait for the target thread: if it isn't the calling
+// thread, they hand their work to it, and it's done before the target's next batch of reactions
 ReactionHandle addFdReaction(EpollReactor&, signed fd, U32 events, FdReaction&&);
-void removeReactionFromThisThread(EpollThread &thisThread, U32 const thisReactionI);
-void addTimerReaction(
+// adds the reaction to a particular thread, rather than the least loaded one
+ReactionHandle addFdReaction(EpollReactor&, U32 targetThreadI, signed fd, U32 events, FdReaction&&);
+void removeReactionFromThisThread(EpollThread &thisThread, FdReaction&);
+// by time spent in reactions over the last load window, then by FD count
+U32 getLeastLoadedThreadI(EpollReactor const&);
+// moves an FD and its reaction from this thread to another
+// $events replaces whatever the FD was registered for
+// the uring backend can't move a reaction whose operations are in flight, so only the epoll backend has this
+ReactionHandle migrateFdReactionFromThisThread(
+	ReactionExecutionInfo,
+	FdReaction&,
+	signed fd,
+	U32 events,
+	U32 targetThreadI
+);
+// with the uring backend, reactions take what they were called for with
+// these, once each. it's gone once the reaction returns
+// the bytes that a receiving socket's reaction was called with, which are
+// empty for the end of the stream or an error, or nullopt if it wasn't called for received bytes
+std::optional<StringView<U32>> takeReceivedBytes(EpollThread &thisThread);
+// the connection that a listening socket's reaction was called for, or -1
+signed takeAcceptedFd(EpollThread &thisThread);
+// the byte count that a send completed with, a negative errno if it failed,
+// or nullopt if the reaction wasn't called for a send
+std::optional<S32> takeSendResult(EpollThread &thisThread);
+// submits $message to be sent on $reaction's FD, and calls the reaction with
+// EPOLLOUT once it's sent. it must stay put until then
+// the thread's FD reactions can each have one send in flight
+void submitSend(EpollThread &thisThread, FdReaction&, msghdr const &message);
+// keeps $o until the send submitted for the reaction with this id completes,
+// for when the reaction's gone first
+void keepUntilSent(EpollThread &thisThread, U32 reactionId, GenericUniquePointer o);
+// asks the reaction's thread, which mustn't be this one, to call it with $events
+// nothing happens if the reaction's gone by then
+// only the uring backend has this, since the epoll backend reports events like EPOLLOUT itself
+void notifyFdReaction(EpollReactor&, ReactionHandle, U32 events);
+
+// runs $func once the calling thread's current batch of reactions is done, so
+// that work the reactions each ask for (like socket writes) can be done once for all of them
+// returns an index for cancelEndOfBatchWork, which is only valid until then
+U32 deferToEndOfBatch(EpollThread &thisThread, DeferredFunc&, void *data);
+void cancelEndOfBatchWork(EpollThread &thisThread, U32 workI);
+struct TimerHandle {
+	U32 reactionThreadI;
+	U32 id;
+};
+TimerHandle addTimerReaction(
 	EpollReactor&,
 	std::chrono::steady_clock::duration interval,
 	TimerReaction&&
 );
+// adds the timer to a particular thread, rather than the next one in turn
+TimerHandle addTimerReaction(
+	EpollReactor&,
+	U32 targetThreadI,
+	std::chrono::steady_clock::duration interval,
+	TimerReaction&&
+);
+// goes off once, $delay from now, and then its reaction is destroyed
+TimerHandle addOneShotTimerReaction(
+	EpollReactor&,
+	std::chrono::steady_clock::duration delay,
+	TimerReaction&&
+);
+TimerHandle addOneShotTimerReaction(
+	EpollReactor&,
+	U32 targetThreadI,
+	std::chrono::steady_clock::duration delay,
+	TimerReaction&&
+);
+// these do nothing if the timer is already gone: cancelled, or a one-shot timer that went off
+// both can be called from any thread, including from the timer's own reaction
+void cancelTimer(EpollReactor&, TimerHandle);
+// the timer next goes off $delay from now, and periodic timers carry on at their interval from then
+void rescheduleTimer(EpollReactor&, TimerHandle, std::chrono::steady_clock::duration delay);
+
+// single-writer sequence lock: the writer never blocks, and readers retry
+// until they read a copy that no write raced with
+// $O is stored as relaxed atomic words, so that a torn read is well-defined
+// (and then discarded) rather than a data race
+template<typename O>
+struct Seqlock {
+	static_assert(std::is_trivially_copyable_v<O>);
+	static_assert(0 == sizeof(O) % sizeof(U32));
+	static auto constexpr wordC= sizeof(O) / sizeof(U32);
+	std::atomic<U32> sequence{0};
+	std::atomic<U32> words[wordC];
+	Seqlock(O const&);
+};
+
+// only one thread may publish to a given seqlock at a time
+template<typename O>
+void publish(Seqlock<O> &seqlock, O const &o) {
+	U32 words[Seqlock<O>::wordC];
+	std::memcpy(words, &o, sizeof o);
+	U32 const sequence= seqlock.sequence.load(std::memory_order_relaxed);
+	// an odd sequence number tells readers that a write is in progress
+	seqlock.sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	for(U8F i=0; i<Seqlock<O>::wordC; ++i)
+		seqlock.words[i].store(words[i], std::memory_order_relaxed);
+	seqlock.sequence.store(sequence + 2, std::memory_order_release);
+}
+
+// $sequence is set to the sequence number of the returned copy, which only
+// changes when something is published
+template<typename O>
+O loadConsistent(Seqlock<O> const &seqlock, U32 &sequence) {
+	U32 words[Seqlock<O>::wordC];
+	for(;;) {
+		sequence= seqlock.sequence.load(std::memory_order_acquire);
+		if(sequence & 1)
+			continue;
+		for(U8F i=0; i<Seqlock<O>::wordC; ++i)
+			words[i]= seqlock.words[i].load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if(sequence == seqlock.sequence.load(std::memory_order_relaxed))
+			break;
+	}
+	O ret;
+	std::memcpy(&ret, words, sizeof ret);
+	return ret;
+}
+template<typename O>
+O loadConsistent(Seqlock<O> const &seqlock) {
+	U32 sequence;
+	return loadConsistent(seqlock, sequence);
+}
+
+template<typename O>
+Seqlock<O>::Seqlock(O const &o) {
+	publish(*this, o);
+}
@@ -1,87 +1,172 @@
-#include<cstring> // std::memmove
+#include<algorithm> // std::min
+#include<cstring> // std::memcpy
+#include<optional> // std::optional
+#include<sys/socket.h> // recvmmsg
 #include<unistd.h>
-#include"memcpy.hpp"
 #include"networking.hpp"
+// handles each complete frame at the start of $src, and returns how many bytes
+// they took, or nullopt if one was malformed, after calling $handleEndOfStream
+template<typename HandleMessage, typename HandleEndOfStream>
+std::optional<U32> handleFrames(
+	char const *const src,
+	U32 const srcByteC,
+	HandleMessage &handleMessage,
+	HandleEndOfStream &handleEndOfStream
+) {
+	U32 byteC= 0;
+	for(;;) {
+		Frame frame;
+		auto const decodeResult= decodeFrame(frame, src + byteC, srcByteC - byteC);
+		// the rest is left for more bytes to complete
+		if(decodeResult == FrameDecodeResult::incomplete)
+			return byteC;
+		if(decodeResult == FrameDecodeResult::malformed) {
+			handleEndOfStream();
+			return std::nullopt;
+		}
+		// actually handle a message
+		handleMessage(frame.type, frame.payload, frame.payloadByteC);
+		byteC+= frame.byteC;
+	}
+}
+
+// handles all complete frames in the ring, in place, and returns false if the stream ended
+template<typename HandleMessage, typename HandleEndOfStream>
+bool handleRingFrames(
+	AsyncRead &asyncRead,
+	HandleMessage &handleMessage,
+	HandleEndOfStream &handleEndOfStream
+) {
+	auto const byteC= handleFrames(asyncRead.o + asyncRead.head, asyncRead.size, handleMessage, handleEndOfStream);
+	if(!byteC)
+		return false;
+	asyncRead.head= (asyncRead.head + *byteC) & (asyncRead.capacity - 1);
+	asyncRead.size-= *byteC;
+	return true;
+}
+
+// with the uring backend, the bytes were already received into one of the thread's buffers
+template<typename HandleMessage, typename HandleEndOfStream>
+void handleReceivedBytes(
+	AsyncRead &asyncRead,
+	StringView<U32> const received,
+	HandleMessage &handleMessage,
+	HandleEndOfStream &handleEndOfStream
+) {
+	if(!received.size) {
+		handleEndOfStream();
+		return;
+	}
+	char const *src= received.o;
+	U32 srcByteC= received.size;
+	// while nothing's left over from earlier, frames are handled straight from the buffer
+	if(!asyncRead.size) {
+		auto const byteC= handleFrames(src, srcByteC, handleMessage, handleEndOfStream);
+		if(!byteC)
+			return;
+		src+= *byteC;
+		srcByteC-= *byteC;
+	}
+	// the rest is copied to the ring, since the buffer's handed back after this
+	while(srcByteC) {
+		if(asyncRead.size == asyncRead.capacity && !growReceiveRing(asyncRead)) {
+			handleEndOfStream();
+			return;
+		}
+		U32 const byteC= std::min(srcByteC, asyncRead.capacity - asyncRead.size);
+		std::memcpy(asyncRead.o + ((asyncRead.head + asyncRead.size) & (asyncRead.capacity - 1)), src, byteC);
+		asyncRead.size+= byteC;
+		src+= byteC;
+		srcByteC-= byteC;
+		if(!handleRingFrames(asyncRead, handleMessage, handleEndOfStream))
+			return;
+	}
+}
+
 /* handleMessage
 	- should look like
-		(MessageType messageType, char const *scanPos, Size remainingByteC) -> <some integral type>
-	- it should return -1 if there isn't enough space to read the message,
-		or the message length if the message was read and processed
+		(MessageType messageType, char const *payload, U32 payloadByteC) -> void
+	- it's called once each message's whole frame has been received, and
+		should ignore types it doesn't know, and whatever follows the part of
+		the payload it knows
 */
 template<typename HandleMessage, typename HandleEndOfStream>
 void handleMessageStreamReadable(
-	signed const fd,
-	AsyncRead &asyncRead,
+	AsyncSocket &socket,
+	ReactionExecutionInfo const execInfo,
 	HandleMessage &&handleMessage,
 	HandleEndOfStream &&handleEndOfStream
 ) {
+	auto &asyncRead= socket.asyncRead;
+	if constexpr(reactorBackend == ReactorBackend::uring) {
+		if(auto const received= takeReceivedBytes(getThisThread(execInfo)))
+			handleReceivedBytes(asyncRead, *received, handleMessage, handleEndOfStream);
+		return;
+	}
 //	std::cout << "start handleMessageStreamReadable...\n";
-	char messages[maxMessageLength * maxMessagesToReceiveAtOnce];
-	U32F incompleteMessageLength= asyncRead.incompleteMessageLength;
-	char *incompleteMessage= asyncRead.incompleteMessage;
 	for(;;) {
-		std::memmove(messages, incompleteMessage, incompleteMessageLength);
-		// read new messages
+		// a message that's still incomplete when the ring is full needs a bigger ring
+		if(asyncRead.size == asyncRead.capacity && !growReceiveRing(asyncRead)) {
+			handleEndOfStream();
+			break;
+		}
+		// read new messages straight into the ring, after what's left of the last read
 		ssize_t const readRet= read(
-			fd,
-			messages + incompleteMessageLength,
-			sizeof messages - incompleteMessageLength
+			socket.fd,
+			asyncRead.o + ((asyncRead.head + asyncRead.size) & (asyncRead.capacity - 1)),
+			asyncRead.capacity - asyncRead.size
 		);
 		// check for end of stream or read error
 		if(-1 == readRet) {
-			if(EAGAIN == errno || EWOULDBLOCK == errno) {
-				asyncRead.incompleteMessageLength= incompleteMessageLength;
-				std::memcpy(
-					asyncRead.incompleteMessage,
-					messages,
-					incompleteMessageLength
-				);
+			if(EINTR == errno)
+				continue;
+			if(EAGAIN == errno || EWOULDBLOCK == errno)
 				break;
-			}
 		}
 		if(-1 == readRet && ECONNRESET == errno || 0 == readRet) {
 			handleEndOfStream();
 			break;
 		}
 		PERROR_ASSERT(0 < readRet);
-		// handle all complete messages in $messages
-		U32F const filledByteC= incompleteMessageLength + readRet;
-		for(U32F scanI= 0;;) {
-			char *const scanPos= messages + scanI;
-			U32F const remainingByteC= filledByteC - scanI;
-			// store the incomplete message for later
-			auto const &handleIncompleteMessage= [
-				&incompleteMessageLength, &incompleteMessage,
-				remainingByteC, scanPos
-			]{
-				incompleteMessageLength= remainingByteC;
-				incompleteMessage= scanPos;
-			};
-			if(remainingByteC < sizeof(MessageType)) {
-				handleIncompleteMessage();
-				break;
-			}
-			MessageType const messageType= [scanPos]{
-				if constexpr(std::is_same_v<MessageType, char>)
-					return *scanPos;
-				else {
-					MessageType ret;
-					memcpyInit(ret, &scanPos);
-					return ret;
-				}
-			}();
-			// actually handle a message
-			auto const handleMessageRet= handleMessage(
-				messageType,
-				static_cast<char const*>(scanPos) + sizeof messageType,
-				remainingByteC - sizeof messageType
-			);
-			if(handleMessageRet == static_cast<decltype(handleMessageRet)>(-1)) {
-				handleIncompleteMessage();
-				break;
-			}
-			ASSERT(0 <= handleMessageRet);
-			scanI += sizeof messageType + handleMessageRet;
+		asyncRead.size+= readRet;
+		if(!handleRingFrames(asyncRead, handleMessage, handleEndOfStream))
+			return;
+	}
+}
+
+// receives what's waiting on the UDP socket $fd, $datagramBatchSize datagrams
+// per syscall, and passes each batch to $handleDatagrams
+// $handleDatagrams should look like (Datagram const *datagrams, U32 datagramC) -> void
+template<typename HandleDatagrams>
+void receiveDatagrams(signed const fd, HandleDatagrams &&handleDatagrams) {
+	char bufs[datagramBatchSize][maxDatagramByteC];
+	sockaddr_in addrs[datagramBatchSize];
+	iovec iovs[datagramBatchSize];
+	mmsghdr messages[datagramBatchSize];
+	Datagram datagrams[datagramBatchSize];
+	for(;;) {
+		for(U32 i=0; i<datagramBatchSize; ++i) {
+			iovs[i]= {bufs[i], sizeof bufs[i]};
+			messages[i]= {};
+			messages[i].msg_hdr.msg_name= &addrs[i];
+			messages[i].msg_hdr.msg_namelen= sizeof addrs[i];
+			messages[i].msg_hdr.msg_iov= &iovs[i];
+			messages[i].msg_hdr.msg_iovlen= 1;
+		}
+		signed const receivedC= recvmmsg(fd, messages, datagramBatchSize, 0, nullptr);
+		if(-1 == receivedC) {
+			if(EINTR == errno)
+				continue;
+			// nothing's waiting, or an earlier datagram couldn't be delivered
+			return;
 		}
+		U32 datagramC= 0;
+		for(signed i=0; i<receivedC; ++i)
+			// one too big for the buffer arrives cut short, so it's dropped
+			if(!(messages[i].msg_hdr.msg_flags & MSG_TRUNC))
+				datagrams[datagramC++]= {bufs[i], messages[i].msg_len, &addrs[i]};
+		handleDatagrams(static_cast<Datagram const*>(datagrams), datagramC);
+		if(receivedC < static_cast<signed>(datagramBatchSize))
+			return;
 	}
 }
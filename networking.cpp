@@ -1,86 +1,648 @@
-#include<cstring> // std::memmove
+#include<algorithm> // std::clamp, std::min
+#include<cmath> // std::cos, std::lround, std::sin
+#include<cstdlib> // std::atoi, std::getenv
+#include<cstring> // std::memcpy
+#include<sys/mman.h> // memfd_create, mmap
+#include<sys/socket.h> // sendmsg, sendmmsg, MSG_NOSIGNAL, shutdown
+#include<sys/uio.h> // iovec
 #include<unistd.h>
+#include<utility> // std::exchange
 #include"networking.hpp"
 
-AsyncSocket::AsyncSocket(EpollReactor &reactor, signed fd, U32 epollEvents, FdReaction &&reaction):
+// with the uring backend, the reaction is called with what the socket received
+static FdReaction &&withReceiveOperation(FdReaction &reaction) {
+	reaction.operation= FdOperation::receive;
+	return std::move(reaction);
+}
+
+AsyncSocket::AsyncSocket(
+	EpollReactor &reactor,
+	U32 const reactionThreadI,
+	signed fd,
+	U32 epollEvents,
+	FdReaction &&reaction
+):
+	reactor{reactor},
 	fd{fd},
 	reactionHandle{addFdReaction(
 		reactor,
+		reactionThreadI,
 		fd,
 		epollEvents,
-		std::move(reaction)
+		withReceiveOperation(reaction)
 	)}
 {}
+AsyncSocket::AsyncSocket(EpollReactor &reactor, signed fd, U32 epollEvents, FdReaction &&reaction):
+	AsyncSocket{reactor, getLeastLoadedThreadI(reactor), fd, epollEvents, std::move(reaction)}
+{}
+
+AsyncSocket::~AsyncSocket() {
+	if(asyncWrite.flushThread)
+		cancelEndOfBatchWork(*asyncWrite.flushThread, asyncWrite.flushWorkI);
+	// the kernel reads what a send in flight points at until it completes, so
+	// the queue goes with it. sockets are destroyed on their reaction's thread
+	if(reactorBackend == ReactorBackend::uring && asyncWrite.willNotifyOnWritable) {
+		auto &send= *asyncWrite.submittedSend;
+		send.ring= std::move(asyncWrite.ring);
+		send.segments= std::move(asyncWrite.segments);
+		keepUntilSent(
+			reactor.reactorThreads[reactionHandle.reactionThreadI],
+			reactionHandle.reactionId,
+			{Tag::defaultDeleted, *asyncWrite.submittedSend.release()}
+		);
+	}
+}
+
+// maps $capacity bytes of memory twice, back to back
+static char *mapMirroredRing(U32 const capacity) {
+	signed const memFd= memfd_create("receive ring", MFD_CLOEXEC);
+	PERROR_ASSERT(-1 != memFd);
+	PERROR_ASSERT(0 == ftruncate(memFd, capacity));
+	// reserves the address range, which the two mappings then replace
+	void *const ret= mmap(nullptr, 2*capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	PERROR_ASSERT(MAP_FAILED != ret);
+	for(U32 half=0; half<2; ++half)
+		PERROR_ASSERT(MAP_FAILED != mmap(
+			static_cast<char*>(ret) + half*capacity,
+			capacity,
+			PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_FIXED,
+			memFd,
+			0
+		));
+	// the mappings keep the memory
+	PERROR_ASSERT(0 == close(memFd));
+	return static_cast<char*>(ret);
+}
+
+AsyncRead::~AsyncRead() {
+	if(o)
+		PERROR_ASSERT(0 == munmap(o, 2*capacity));
+}
+
+bool growReceiveRing(AsyncRead &asyncRead) {
+	if(maxReceiveRingCapacity <= asyncRead.capacity)
+		return false;
+	U32 const capacity= asyncRead.capacity
+		? 2*asyncRead.capacity
+		: static_cast<U32>(sysconf(_SC_PAGESIZE));
+	char *const o= mapMirroredRing(capacity);
+	if(asyncRead.o) {
+		std::memcpy(o, asyncRead.o + asyncRead.head, asyncRead.size);
+		PERROR_ASSERT(0 == munmap(asyncRead.o, 2*asyncRead.capacity));
+	}
+	asyncRead.o= o;
+	asyncRead.capacity= capacity;
+	asyncRead.head= 0;
+	return true;
+}
+
+// the ring never shrinks, so this is only allocated once for most sockets
+U32 constexpr minRingCapacity= 1 << 12;
+
+// copies $byteC bytes of $ring starting at $i, which may wrap around its end
+static void readRing(ByteRing const &ring, U32 const i, U32 const byteC, char *const dst) {
+	U32 const firstByteC= std::min(byteC, ring.capacity - i);
+	std::memcpy(dst, ring.o.get() + i, firstByteC);
+	std::memcpy(dst + firstByteC, ring.o.get(), byteC - firstByteC);
+}
+
+static void writeRing(ByteRing &ring, U32 const i, char const *const src, U32 const byteC) {
+	U32 const firstByteC= std::min(byteC, ring.capacity - i);
+	std::memcpy(ring.o.get() + i, src, firstByteC);
+	std::memcpy(ring.o.get(), src + firstByteC, byteC - firstByteC);
+}
+
+// moves the copied bytes to the start of a ring that fits $minCapacity
+static void growRing(AsyncWrite &asyncWrite, U32 const minCapacity) {
+	auto &ring= asyncWrite.ring;
+	U32 capacity= std::max(ring.capacity, minRingCapacity);
+	while(capacity < minCapacity)
+		capacity*= 2;
+	std::unique_ptr<char[]> o{new char[capacity]};
+	if(ring.size)
+		readRing(ring, ring.head, ring.size, o.get());
+	for(auto &segment : asyncWrite.segments)
+		if(!segment.keepAlive)
+			segment.offset= (segment.offset - ring.head) & (ring.capacity - 1);
+	// a send in flight still points into the old one
+	if(reactorBackend == ReactorBackend::uring && asyncWrite.willNotifyOnWritable)
+		asyncWrite.submittedSend->replacedRings.push_back(std::move(ring.o));
+	ring= {std::move(o), capacity, 0, ring.size};
+}
+
+// returns where in the ring $src was copied to
+static U32 pushToRing(AsyncWrite &asyncWrite, StringView<std::size_t> const src) {
+	auto &ring= asyncWrite.ring;
+	if(ring.capacity - ring.size < src.size)
+		growRing(asyncWrite, ring.size + src.size);
+	U32 const ret= (ring.head + ring.size) & (ring.capacity - 1);
+	writeRing(ring, ret, src.o, src.size);
+	ring.size+= src.size;
+	return ret;
+}
+
+// frees $byteC bytes from the head of the ring once they're written
+static void popFromRing(ByteRing &ring, U32 const byteC) {
+	ring.head= (ring.head + byteC) & (ring.capacity - 1);
+	ring.size-= byteC;
+}
+
+// removes segments[$segmentI] from the queue's byte counts, closing the gap it
+// leaves in the ring, but leaves it in $asyncWrite.segments
+static void forgetSegment(AsyncWrite &asyncWrite, std::size_t const segmentI) {
+	auto &segments= asyncWrite.segments;
+	auto const &segment= segments[segmentI];
+	asyncWrite.queuedByteC-= segment.size;
+	if(segment.keepAlive)
+		return;
+	auto &ring= asyncWrite.ring;
+	U32 const mask= ring.capacity - 1;
+	// the copied bytes after this segment's move back over it
+	U32 const afterByteC= ring.size - ((segment.offset - ring.head) & mask) - segment.size;
+	for(U32 i=0; i<afterByteC; ++i)
+		ring.o[(segment.offset + i) & mask]= ring.o[(segment.offset + segment.size + i) & mask];
+	ring.size-= segment.size;
+	for(auto i= segmentI + 1; i < segments.size(); ++i)
+		if(!segments[i].keepAlive)
+			segments[i].offset= (segments[i].offset - segment.size) & mask;
+}
+
+// drops queued supersedable messages, oldest first, until $byteC more bytes fit,
+// or all of them if $dropAll. a message that's partly written, or being sent, is kept
+static void dropSupersedableMessages(AsyncWrite &asyncWrite, U32 const byteC, bool const dropAll) {
+	auto &segments= asyncWrite.segments;
+	std::size_t segmentI= asyncWrite.sendingSegmentC;
+	for(; segmentI < segments.size() && !segments[segmentI].startsMessage; ++segmentI);
+	while(
+		segmentI < segments.size()
+		&& (dropAll || asyncWrite.byteCap < asyncWrite.queuedByteC + byteC)
+	) {
+		auto endI= segmentI + 1;
+		for(; endI < segments.size() && !segments[endI].startsMessage; ++endI);
+		if(segments[segmentI].durability != MessageDurability::supersedable) {
+			segmentI= endI;
+			continue;
+		}
+		for(auto i= segmentI; i < endI; ++i)
+			forgetSegment(asyncWrite, i);
+		segments.erase(begin(segments) + segmentI, begin(segments) + endI);
+		asyncWrite.droppedMessages= true;
+	}
+}
 
-// returns the count of written bytes
-static U32 writeAsMuchAsPossible(
-	signed const fd,
-	StringView<FastInteger<MessageBufSize>> const src
+static void clearQueue(AsyncWrite &asyncWrite) {
+	asyncWrite.segments.clear();
+	asyncWrite.ring.head= asyncWrite.ring.size= 0;
+	asyncWrite.queuedByteC= 0;
+}
+
+// the socket's reaction then sees the connection close, and handles it like any other hang-up
+// $socket.asyncWrite.bufMutex must be held
+static void kick(AsyncSocket &socket) {
+	auto &asyncWrite= socket.asyncWrite;
+	asyncWrite.isKicked= true;
+	// with the uring backend, a send in flight still points into the queue, so
+	// it's cleared once that completes
+	if(reactorBackend == ReactorBackend::epoll || !asyncWrite.willNotifyOnWritable)
+		clearQueue(asyncWrite);
+	PERROR_ASSERT(0 == shutdown(socket.fd, SHUT_RDWR) || ENOTCONN == errno);
+}
+
+// returns whether the message was queued, or was dropped or got its peer kicked for not fitting
+// $socket.asyncWrite.bufMutex must be held
+static bool queueMessage(
+	AsyncSocket &socket,
+	std::initializer_list<StringView<std::size_t>> const parts,
+	std::shared_ptr<void const> const &keepAlive,
+	MessageDurability const durability
+) {
+	auto &asyncWrite= socket.asyncWrite;
+	if(asyncWrite.isKicked)
+		return false;
+	std::size_t byteC= 0;
+	for(auto const &part : parts)
+		byteC+= part.size;
+	if(!byteC)
+		return false;
+	bool const isSupersedable= durability == MessageDurability::supersedable;
+	if(asyncWrite.byteCap < asyncWrite.queuedByteC + byteC) {
+		// they're stale now, whether or not this one needs their space
+		dropSupersedableMessages(asyncWrite, byteC, isSupersedable);
+		if(asyncWrite.byteCap < asyncWrite.queuedByteC + byteC) {
+			if(isSupersedable && asyncWrite.overflowPolicy == SendQueueOverflowPolicy::degrade) {
+				asyncWrite.droppedMessages= true;
+				return false;
+			}
+			kick(socket);
+			return false;
+		}
+	}
+	bool startsMessage= true;
+	for(auto const &part : parts) {
+		if(!part.size)
+			continue;
+		if(keepAlive)
+			asyncWrite.segments.push_back({
+				keepAlive, part.o, 0, static_cast<U32>(part.size), startsMessage, durability
+			});
+		else
+			asyncWrite.segments.push_back({
+				nullptr, nullptr, pushToRing(asyncWrite, part), static_cast<U32>(part.size), startsMessage, durability
+			});
+		startsMessage= false;
+	}
+	asyncWrite.queuedByteC+= byteC;
+	return true;
+}
+
+// frees the first $byteC bytes of $segment, which is the first segment queued
+static void consumeSegment(AsyncWrite &asyncWrite, OutboundSegment &segment, U32 const byteC) {
+	asyncWrite.queuedByteC-= byteC;
+	if(segment.keepAlive) {
+		segment.data+= byteC;
+	} else {
+		ASSERT(segment.offset == asyncWrite.ring.head);
+		popFromRing(asyncWrite.ring, byteC);
+		segment.offset= asyncWrite.ring.head;
+	}
+	segment.size-= byteC;
+	segment.startsMessage= false;
+}
+
+// points $iovs at as much of the queue from segments[$segmentI] on as fits in
+// maxSegmentsPerWrite, and returns how many it used. $endSegmentI is set to
+// the first segment that didn't fit
+static U32F gatherSegments(
+	AsyncWrite const &asyncWrite,
+	U32F const segmentI,
+	iovec *const iovs,
+	U32F &endSegmentI
 ) {
-	for(U32F pos=0;;) {
-		auto const leftByteC= src.size - pos;
-		if(!leftByteC)
-			return src.size;
-		auto const writeRet= write(fd, src.o + pos, leftByteC);
-		if(0 < writeRet) {
-			pos+= writeRet;
+	auto const &segments= asyncWrite.segments;
+	auto const &ring= asyncWrite.ring;
+	U32F iovC= 0;
+	// a copied segment takes 2 if it wraps around the end of the ring
+	for(endSegmentI= segmentI; endSegmentI < segments.size() && iovC + 2 <= maxSegmentsPerWrite; ++endSegmentI) {
+		auto const &segment= segments[endSegmentI];
+		if(segment.keepAlive) {
+			iovs[iovC++]= {const_cast<char*>(segment.data), segment.size};
 			continue;
 		}
-		// TODO: this fails when the peer disconnects, which should be handled
-		if(writeRet == -1 && errno == EAGAIN)
-			UNIMPLEMENTED;
-		return pos;
+		U32 const firstByteC= std::min(segment.size, ring.capacity - segment.offset);
+		iovs[iovC++]= {ring.o.get() + segment.offset, firstByteC};
+		if(firstByteC < segment.size)
+			iovs[iovC++]= {ring.o.get(), segment.size - firstByteC};
 	}
-	unreachable();
+	return iovC;
 }
 
-void scheduleSocketWrite(
+// frees $byteC written bytes from segments[$segmentI] on, and returns the
+// index of the first segment that's not all written
+static U32F consumeWrittenBytes(AsyncWrite &asyncWrite, U32F segmentI, U32F byteC) {
+	auto &segments= asyncWrite.segments;
+	while(byteC) {
+		auto &segment= segments[segmentI];
+		U32F const segmentByteC= std::min<U32F>(byteC, segment.size);
+		consumeSegment(asyncWrite, segment, segmentByteC);
+		byteC-= segmentByteC;
+		if(segment.size)
+			break;
+		++segmentI;
+	}
+	return segmentI;
+}
+
+// for when nothing more can be written, and returns the queue's segment count
+static U32F dropUnwritable(AsyncWrite &asyncWrite, U32F segmentI) {
+	auto &segments= asyncWrite.segments;
+	for(; segmentI < segments.size(); ++segmentI)
+		consumeSegment(asyncWrite, segments[segmentI], segments[segmentI].size);
+	return segmentI;
+}
+
+// writes as much of the queue as the socket takes, and returns whether that was all of it
+// $asyncWrite.bufMutex must be held
+static bool writeSegments(signed const fd, AsyncWrite &asyncWrite) {
+	auto &segments= asyncWrite.segments;
+	U32F segmentI= 0;
+	while(segmentI < segments.size()) {
+		iovec iovs[maxSegmentsPerWrite];
+		U32F endSegmentI;
+		msghdr message{};
+		message.msg_iov= iovs;
+		message.msg_iovlen= gatherSegments(asyncWrite, segmentI, iovs, endSegmentI);
+		// if the peer has gone, its reaction finds out by reading, rather than the process getting SIGPIPE
+		ssize_t const sendRet= sendmsg(fd, &message, MSG_NOSIGNAL);
+		if(-1 == sendRet) {
+			if(EINTR == errno)
+				continue;
+			if(EAGAIN == errno || EWOULDBLOCK == errno)
+				break;
+			segmentI= dropUnwritable(asyncWrite, segmentI);
+			break;
+		}
+		segmentI= consumeWrittenBytes(asyncWrite, segmentI, sendRet);
+	}
+	segments.erase(begin(segments), begin(segments) + segmentI);
+	return segments.empty();
+}
+
+// submits a send of the front of the queue, which calls the socket's reaction
+// with EPOLLOUT once it completes
+// $socket.asyncWrite.bufMutex must be held
+static void submitSegments(AsyncSocket &socket, EpollThread &thisThread) {
+	auto &asyncWrite= socket.asyncWrite;
+	if(!asyncWrite.submittedSend)
+		asyncWrite.submittedSend= std::make_unique<SubmittedSend>();
+	auto &send= *asyncWrite.submittedSend;
+	U32F sendingSegmentC;
+	send.message= {};
+	send.message.msg_iov= send.iovs;
+	send.message.msg_iovlen= gatherSegments(asyncWrite, 0, send.iovs, sendingSegmentC);
+	asyncWrite.sendingSegmentC= sendingSegmentC;
+	submitSend(thisThread, *socket.reactionHandle.reaction, send.message);
+	asyncWrite.willNotifyOnWritable= true;
+}
+
+static void setSocketEvents(AsyncSocket &socket, U32 const events) {
+	epoll_event event;
+	event.events= events;
+	event.data.ptr= socket.reactionHandle.reaction;
+	PERROR_ASSERT(0 == epoll_ctl(
+		socket.reactor.reactorThreads[socket.reactionHandle.reactionThreadI].epollFd,
+		EPOLL_CTL_MOD,
+		socket.fd,
+		&event
+	));
+}
+
+// writes what's queued, and leaves what the socket won't take to be written when it's writable
+// $socket.asyncWrite.bufMutex must be held
+static void flushSocket(AsyncSocket &socket) {
+	auto &asyncWrite= socket.asyncWrite;
+	if constexpr(reactorBackend == ReactorBackend::uring) {
+		if(asyncWrite.willNotifyOnWritable || asyncWrite.segments.empty())
+			return;
+		auto &reactionThread= socket.reactor.reactorThreads[socket.reactionHandle.reactionThreadI];
+		if(isThisThread(reactionThread))
+			submitSegments(socket, reactionThread);
+		// only the reaction's thread submits to its ring, so what this one can't write is left to it
+		else if(!writeSegments(socket.fd, asyncWrite))
+			notifyFdReaction(socket.reactor, socket.reactionHandle, EPOLLOUT);
+		return;
+	}
+	if(asyncWrite.willNotifyOnWritable || writeSegments(socket.fd, asyncWrite))
+		return;
+	if constexpr(socketTriggering == SocketTriggering::level)
+		setSocketEvents(socket, defaultSocketEvents | EPOLLOUT);
+	asyncWrite.willNotifyOnWritable= true;
+}
+
+static void flushSocketAtEndOfBatch(void *const socket_) {
+	auto &socket= *static_cast<AsyncSocket*>(socket_);
+	std::lock_guard g{socket.asyncWrite.bufMutex};
+	socket.asyncWrite.flushThread= nullptr;
+	flushSocket(socket);
+}
+
+static void scheduleSocketWrite(
 	AsyncSocket &socket,
-	StringView<FastInteger<MessageBufSize>> const src,
-	EpollReactor &reactor
+	std::initializer_list<StringView<std::size_t>> const parts,
+	std::shared_ptr<void const> const &keepAlive,
+	MessageDurability const durability
 ) {
-	std::lock_guard g0{socket.asyncWrite.bufMutex};
-	U32 const writtenByteC= socket.asyncWrite.buf.empty()
-		? writeAsMuchAsPossible(socket.fd, src)
-		: 0;
-	if(writtenByteC == src.size)
-		// there's nothing to schedule, we were able to immediately write the whole message
+	auto &asyncWrite= socket.asyncWrite;
+	std::lock_guard g{asyncWrite.bufMutex};
+	bool const wasEmpty= asyncWrite.segments.empty();
+	if(!queueMessage(socket, parts, keepAlive, durability))
+		return;
+	// otherwise, this is written after what's ahead of it, whenever that is
+	if(!wasEmpty)
+		return;
+	auto &reactionThread= socket.reactor.reactorThreads[socket.reactionHandle.reactionThreadI];
+	if(!isThisThread(reactionThread)) {
+		flushSocket(socket);
 		return;
-	auto &dst= socket.asyncWrite.buf;
-	dst.insert(end(dst), begin(src) + writtenByteC, end(src));
-	if(!socket.asyncWrite.willNotifyOnWritable) {
-		epoll_event event;
-		event.events= defaultSocketEvents | EPOLLOUT;
-		event.data.u32= socket.reactionHandle.epollReactionI;
-		epoll_ctl(
-			reactor.reactorThreads[socket.reactionHandle.reactionThreadI].epollFd,
-			EPOLL_CTL_MOD,
-			socket.fd,
-			&event
-		);
-		socket.asyncWrite.willNotifyOnWritable= true;
 	}
+	asyncWrite.flushThread= &reactionThread;
+	asyncWrite.flushWorkI= deferToEndOfBatch(reactionThread, flushSocketAtEndOfBatch, &socket);
+}
+
+void scheduleSocketWrite(
+	AsyncSocket &socket,
+	StringView<std::size_t> const src,
+	EpollReactor&,
+	MessageDurability const durability
+) {
+	scheduleSocketWrite(socket, {src}, nullptr, durability);
+}
+
+void scheduleSharedSocketWrite(
+	AsyncSocket &socket,
+	std::initializer_list<StringView<std::size_t>> const parts,
+	std::shared_ptr<void const> keepAlive,
+	EpollReactor&,
+	MessageDurability const durability
+) {
+	scheduleSocketWrite(socket, parts, keepAlive, durability);
+}
+
+bool takeDroppedMessages(AsyncSocket &socket) {
+	std::lock_guard g{socket.asyncWrite.bufMutex};
+	return std::exchange(socket.asyncWrite.droppedMessages, false);
 }
 
 void handleMessageStreamWritable(
 	AsyncSocket &socket,
 	ReactionExecutionInfo const execInfo
 ) {
-	std::cout << "start handleMessageStreamWritable\n";
 	auto &asyncWrite= socket.asyncWrite;
-	auto &buf= asyncWrite.buf;
 	std::lock_guard g{asyncWrite.bufMutex};
-	auto const writtenByteC= writeAsMuchAsPossible(socket.fd, {buf.data(), buf.size()});
-	U32 const leftByteC= buf.size() - writtenByteC;
-	std::memmove(buf.data(), buf.data() + writtenByteC, leftByteC);
-	buf.resize(leftByteC);
-	epoll_event event;
-	event.events= defaultSocketEvents; // deregister notification for writability
-	event.data.u32= socket.reactionHandle.epollReactionI;
-	epoll_ctl(
-		execInfo.thisReactor.reactorThreads[execInfo.thisThreadI].epollFd,
-		EPOLL_CTL_MOD,
+	if constexpr(reactorBackend == ReactorBackend::uring) {
+		auto &thisThread= getThisThread(execInfo);
+		if(auto const sendRet= takeSendResult(thisThread)) {
+			auto &segments= asyncWrite.segments;
+			U32F const segmentI= 0 <= *sendRet
+				? consumeWrittenBytes(asyncWrite, 0, *sendRet)
+				// nothing more can be written, so the rest is dropped
+				: dropUnwritable(asyncWrite, 0);
+			segments.erase(begin(segments), begin(segments) + segmentI);
+			asyncWrite.submittedSend->replacedRings.clear();
+			asyncWrite.sendingSegmentC= 0;
+			asyncWrite.willNotifyOnWritable= false;
+			if(asyncWrite.isKicked)
+				clearQueue(asyncWrite);
+		}
+		// otherwise, another thread left what it couldn't write for this one
+		flushSocket(socket);
+		return;
+	}
+	// edge-triggered sockets report EPOLLOUT alongside EPOLLIN whenever they're
+	// writable, not just when something's waiting to be written
+	if constexpr(socketTriggering == SocketTriggering::edge)
+		if(!asyncWrite.willNotifyOnWritable)
+			return;
+	if(!writeSegments(socket.fd, asyncWrite))
+		return;
+	// deregister notification for writability
+	if constexpr(socketTriggering == SocketTriggering::level)
+		setSocketEvents(socket, defaultSocketEvents);
+	asyncWrite.willNotifyOnWritable= false;
+}
+
+void migrateSocketFromThisThread(
+	AsyncSocket &socket,
+	ReactionExecutionInfo const execInfo,
+	U32 const targetThreadI
+) {
+	ASSERT(socket.reactionHandle.reactionThreadI == execInfo.thisThreadI);
+	// scheduleSocketWrite reads the reaction handle while holding this
+	std::lock_guard g{socket.asyncWrite.bufMutex};
+	// a flush deferred on this thread would race with the socket being destroyed on the other
+	if(socket.asyncWrite.flushThread) {
+		cancelEndOfBatchWork(*socket.asyncWrite.flushThread, socket.asyncWrite.flushWorkI);
+		socket.asyncWrite.flushThread= nullptr;
+		flushSocket(socket);
+	}
+	socket.reactionHandle= migrateFdReactionFromThisThread(
+		execInfo,
+		*socket.reactionHandle.reaction,
 		socket.fd,
-		&event
+		defaultSocketEvents | (socket.asyncWrite.willNotifyOnWritable ? U32{EPOLLOUT} : 0),
+		targetThreadI
 	);
 }
+
+static U8 getShimPercent(char const *const variableName) {
+	char const *const value= std::getenv(variableName);
+	return value ? static_cast<U8>(std::clamp(std::atoi(value), 0, 100)) : 0;
+}
+
+DatagramShim::DatagramShim():
+	lossPercent{getShimPercent("UDP_SHIM_LOSS")},
+	duplicatePercent{getShimPercent("UDP_SHIM_DUPLICATE")},
+	reorderPercent{getShimPercent("UDP_SHIM_REORDER")},
+	random{std::random_device{}()}
+{}
+
+UdpSocket::UdpSocket(signed const fd): fd{fd} {}
+
+UdpSocket::~UdpSocket() {
+	PERROR_ASSERT(0 == close(fd));
+}
+
+static void sendAllDatagrams(signed const fd, mmsghdr *const messages, U32 const messageC) {
+	for(U32 sentC=0; sentC<messageC; ) {
+		signed const sendRet= sendmmsg(fd, messages + sentC, messageC - sentC, 0);
+		if(-1 == sendRet) {
+			if(EINTR == errno)
+				continue;
+			// the socket's buffer is full, so the rest would be too
+			if(EAGAIN == errno || EWOULDBLOCK == errno)
+				return;
+			// e.g. nothing is listening where this one was going
+			++sentC;
+			continue;
+		}
+		sentC+= sendRet;
+	}
+}
+
+void sendDatagrams(UdpSocket &socket, mmsghdr *const messages, U32 const messageC) {
+	auto &shim= socket.shim;
+	if(!shim.lossPercent && !shim.duplicatePercent && !shim.reorderPercent) {
+		sendAllDatagrams(socket.fd, messages, messageC);
+		return;
+	}
+	std::lock_guard g{shim.mutex};
+	auto const roll= [&shim](U8 const percent) {
+		return std::uniform_int_distribution<unsigned>{0, 99}(shim.random) < percent;
+	};
+	// the datagram held back by an earlier call goes after the first one of these that's sent
+	std::vector<char> released;
+	sockaddr_in releasedAddr;
+	iovec releasedIov;
+	mmsghdr releasedMessage{};
+	bool isReleasing= std::exchange(shim.isHoldingBack, false);
+	if(isReleasing) {
+		released.swap(shim.heldBack);
+		releasedAddr= shim.heldBackAddr;
+		releasedIov= {released.data(), released.size()};
+		releasedMessage.msg_hdr.msg_name= shim.heldBackAddrLen ? &releasedAddr : nullptr;
+		releasedMessage.msg_hdr.msg_namelen= shim.heldBackAddrLen;
+		releasedMessage.msg_hdr.msg_iov= &releasedIov;
+		releasedMessage.msg_hdr.msg_iovlen= 1;
+	}
+	std::vector<mmsghdr> shimmed;
+	for(U32 i=0; i<messageC; ++i) {
+		auto const &message= messages[i];
+		if(roll(shim.lossPercent))
+			continue;
+		if(!shim.isHoldingBack && roll(shim.reorderPercent)) {
+			shim.heldBack.clear();
+			for(std::size_t iovI=0; iovI<message.msg_hdr.msg_iovlen; ++iovI) {
+				auto const &iov= message.msg_hdr.msg_iov[iovI];
+				auto const *const base= static_cast<char const*>(iov.iov_base);
+				shim.heldBack.insert(end(shim.heldBack), base, base + iov.iov_len);
+			}
+			shim.heldBackAddrLen= message.msg_hdr.msg_name ? sizeof shim.heldBackAddr : 0;
+			if(shim.heldBackAddrLen)
+				std::memcpy(&shim.heldBackAddr, message.msg_hdr.msg_name, sizeof shim.heldBackAddr);
+			shim.isHoldingBack= true;
+			continue;
+		}
+		shimmed.push_back(message);
+		if(roll(shim.duplicatePercent))
+			shimmed.push_back(message);
+		if(isReleasing) {
+			shimmed.push_back(releasedMessage);
+			isReleasing= false;
+		}
+	}
+	if(isReleasing)
+		shimmed.push_back(releasedMessage);
+	sendAllDatagrams(socket.fd, shimmed.data(), shimmed.size());
+}
+
+DeltaBaseline const *findDeltaBaseline(DeltaBaselines const &baselines, U32 const sequence) {
+	auto const &ret= baselines[sequence % deltaBaselineC];
+	return sequence && ret.sequence == sequence ? &ret : nullptr;
+}
+
+DeltaBaseline &replaceDeltaBaseline(DeltaBaselines &baselines, U32 const sequence) {
+	auto &ret= baselines[sequence % deltaBaselineC];
+	ret.sequence= sequence;
+	ret.positions.clear();
+	return ret;
+}
+
+void applyInput(UpdatePos &position, PlayerInput const &input) {
+	float const step= inputSpeed * std::chrono::duration<float>{inputTick}.count() * PositionComponent::scale;
+	float const forwardX= -step * std::sin(input.yaw);
+	float const forwardY= step * std::cos(input.yaw);
+	float x= 0, y= 0, z= 0;
+	if(input.buttons & inputForward) {
+		x+= forwardX;
+		y+= forwardY;
+	}
+	if(input.buttons & inputBack) {
+		x-= forwardX;
+		y-= forwardY;
+	}
+	if(input.buttons & inputLeft) {
+		x-= forwardY;
+		y+= forwardX;
+	}
+	if(input.buttons & inputRight) {
+		x+= forwardY;
+		y-= forwardX;
+	}
+	if(input.buttons & inputUp)
+		z+= step;
+	if(input.buttons & inputDown)
+		z-= step;
+	position.x+= static_cast<S32>(std::lround(x));
+	position.y+= static_cast<S32>(std::lround(y));
+	position.z+= static_cast<S32>(std::lround(z));
+}
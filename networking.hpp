@@ -1,9 +1,24 @@
 #pragma once
+#include<cstring> // std::memcpy
+#include<initializer_list>
+#include<memory> // std::shared_ptr
+#include<random> // std::minstd_rand
+#include<utility> // std::pair
+#include<vector> // std::vector
+#include<netinet/in.h> // sockaddr_in
+#include<sys/socket.h> // mmsghdr
 #include"common.hpp"
 #include"concurrency.hpp"
+#include"position/cpp.hpp"
+#include"varint.hpp"
 
 typedef char MessageType;
-// server->client message type 0
+// client->server message types, each framed as described at maxFrameHeaderByteC
+// 0: here is my position (an UpdatePos), which servers ignore now that they
+//    move players by their inputs
+// 1: i received the type-5 message with this sequence number
+// 2: here are my latest inputs: the sequence number of the newest, the input
+//    count, then the inputs, oldest first, each as its buttons then its yaw
 struct UpdatePos {
 	S32 x,y,z;
 };
@@ -11,22 +26,215 @@ struct UpdatePos {
 	A(x) B A(y) B A(z)
 #define UPDATE_POS_SIZEOF(x) sizeof UpdatePos::x
 U32 constexpr UpdatePosMessageLength= UPDATE_POS_FOREACH(UPDATE_POS_SIZEOF, +);
+inline bool operator==(UpdatePos const &a, UpdatePos const &b) {
+	return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+inline bool operator!=(UpdatePos const &a, UpdatePos const &b) {
+	return !(a == b);
+}
+
+U32 constexpr AcknowledgeSnapshotMessageLength= sizeof(U32);
+
+// where players start, which is also where the client's camera starts
+UpdatePos const spawnPosition{0, 0, PositionComponent{1}.o};
+
+// which ways a player is being moved
+enum InputButton: U8 {
+	inputForward= 1 << 0,
+	inputBack= 1 << 1,
+	inputLeft= 1 << 2,
+	inputRight= 1 << 3,
+	inputUp= 1 << 4,
+	inputDown= 1 << 5,
+};
+// what a player asked to do over one input tick. clients number each tick's
+// input, and the server plays them in order to move the player, so that it
+// decides where players are, and they can't move faster than inputSpeed
+struct PlayerInput {
+	U8 buttons= 0;
+	// radians, which forward is relative to. forward is +Y when it's 0
+	float yaw= 0;
+};
+U32 constexpr inputByteC= sizeof PlayerInput::buttons + sizeof PlayerInput::yaw;
+// in position units per second
+float constexpr inputSpeed= 3;
+// moves $position as $input says, for one input tick. the server and the
+// client do the same, so that the client can predict where it will be
+void applyInput(UpdatePos &position, PlayerInput const &input);
+
+// every message is framed as its type, then the byte count of its payload as a
+// varint, then the payload. so receivers can skip the types they don't know,
+// and ignore whatever follows the parts of a payload that they do know
+U8F constexpr maxFrameHeaderByteC= sizeof(MessageType) + maxU32VarintByteC;
+// writes the header of a frame whose payload is $payloadByteC bytes, and returns its byte count
+inline U8F writeFrameHeader(char *const dst, MessageType const type, U32 const payloadByteC) {
+	std::memcpy(dst, &type, sizeof type);
+	return sizeof type + writeVarint(dst + sizeof type, payloadByteC);
+}
+inline U8F getFrameHeaderByteC(U32 const payloadByteC) {
+	return sizeof(MessageType) + getVarintByteC(payloadByteC);
+}
+// for a message that's built in $message after maxFrameHeaderByteC bytes that
+// were left for the header, since its length isn't known until it's built
+// writes the header right before the payload, and returns the whole frame
+inline StringView<std::size_t> finishFrame(std::vector<char> &message, MessageType const type) {
+	U32 const payloadByteC= message.size() - maxFrameHeaderByteC;
+	auto const headerI= maxFrameHeaderByteC - getFrameHeaderByteC(payloadByteC);
+	writeFrameHeader(message.data() + headerI, type, payloadByteC);
+	return {message.data() + headerI, message.size() - headerI};
+}
+// a message whose payload is $srcs, which is too short for its byte count to take more than a byte
+template<typename... Srcs>
+auto serialiseMessage(MessageType const type, Srcs const &...srcs) {
+	std::size_t constexpr payloadByteC= (0 + ... + sizeof(Srcs));
+	static_assert(payloadByteC < 0x80);
+	StaticArray<char, sizeof(MessageType) + 1 + payloadByteC> ret{Tag::defaultInitialise};
+	std::size_t offset= writeFrameHeader(getData(ret), type, payloadByteC);
+	(... , [&ret, &offset, &srcs]{
+		std::memcpy(getData(ret) + offset, &srcs, sizeof srcs);
+		offset += sizeof srcs;
+	}());
+	return ret;
+}
 
-U32 constexpr maxMessageLength= sizeof(MessageType) + UpdatePosMessageLength;
+// how many bytes a socket's send queue holds by default, before it starts dropping messages
+U32 constexpr defaultSendQueueByteCap= 1 << 18;
 
+// the received bytes that are yet to be handled. the ring's memory is mapped
+// twice, back to back, so the $size bytes from $head are contiguous even if they wrap
 struct AsyncRead {
-	U32L incompleteMessageLength;
-	char incompleteMessage[maxMessageLength-1];
+	char *o= nullptr;
+	// a power of 2 that's a multiple of the page size, or 0 until the first read
+	U32 capacity= 0;
+	U32 head= 0;
+	U32 size= 0;
+	AsyncRead()= default;
+	AsyncRead(AsyncRead const&)= delete;
+	~AsyncRead();
 };
+// a message that doesn't fit in a ring this big is taken to mean that the peer is broken
+U32 constexpr maxReceiveRingCapacity= 1 << 24;
+// doubles the capacity, keeping what's in the ring
+// returns false if it's already at maxReceiveRingCapacity
+bool growReceiveRing(AsyncRead&);
 
+struct Frame {
+	MessageType type;
+	char const *payload;
+	U32 payloadByteC;
+	// including the header
+	U32 byteC;
+};
+enum class FrameDecodeResult: U8 {
+	complete,
+	// more bytes are needed
+	incomplete,
+	// the header can't be right, or says the frame is too long to ever be received
+	malformed
+};
+// decodes the frame at the start of $src, leaving $dst.payload pointing into $src
+template<typename Size>
+FrameDecodeResult decodeFrame(Frame &dst, char const *const src, Size const srcByteC) {
+	if(srcByteC < sizeof(MessageType))
+		return FrameDecodeResult::incomplete;
+	U64 payloadByteC;
+	U8F const varintByteC= readVarint(
+		payloadByteC,
+		src + sizeof(MessageType),
+		srcByteC - sizeof(MessageType)
+	);
+	if(!varintByteC)
+		return srcByteC - sizeof(MessageType) < maxU32VarintByteC
+			? FrameDecodeResult::incomplete
+			: FrameDecodeResult::malformed;
+	if(maxU32VarintByteC < varintByteC || maxReceiveRingCapacity < payloadByteC)
+		return FrameDecodeResult::malformed;
+	U32 const byteC= sizeof(MessageType) + varintByteC + payloadByteC;
+	if(srcByteC < byteC)
+		return FrameDecodeResult::incomplete;
+	std::memcpy(&dst.type, src, sizeof dst.type);
+	dst.payload= src + sizeof(MessageType) + varintByteC;
+	dst.payloadByteC= payloadByteC;
+	dst.byteC= byteC;
+	return FrameDecodeResult::complete;
+}
+
+// whether a queued message can be dropped before it's written
+enum class MessageDurability: U8 {
+	reliable,
+	// a newer message of the same kind makes it stale, e.g. a message with positions
+	supersedable
+};
+// what a socket does when a message doesn't fit in its send queue, even after
+// the supersedable messages queued ahead of it are dropped
+enum class SendQueueOverflowPolicy: U8 {
+	// disconnects the peer
+	kick,
+	// drops the message if it's supersedable, so the peer gets fewer updates
+	// until it catches up, and only kicks it if a reliable message doesn't fit
+	degrade
+};
+
+// bytes copied into a send queue, oldest first. its capacity is a power of 2
+struct ByteRing {
+	std::unique_ptr<char[]> o;
+	U32 capacity= 0;
+	// the index of the oldest byte
+	U32 head= 0;
+	U32 size= 0;
+};
+// how many queued segments are written to a socket with one syscall
+unsigned constexpr maxSegmentsPerWrite= 64;
+// part of the queue of messages to write to a socket
+struct OutboundSegment {
+	// null if the bytes were copied into AsyncWrite::ring, at $offset
+	// otherwise they're at $data, which this keeps alive
+	std::shared_ptr<void const> keepAlive;
+	char const *data;
+	U32 offset;
+	U32 size;
+	// false for a message's later segments, and for its first once some of that is written
+	bool startsMessage;
+	MessageDurability durability;
+};
+// what a send submitted to the uring backend points at, which has to stay put until it completes
+struct SubmittedSend {
+	msghdr message;
+	iovec iovs[maxSegmentsPerWrite];
+	// rings that were outgrown while the send was in flight
+	std::vector<std::unique_ptr<char[]>> replacedRings;
+	// the queue is moved here if the socket goes before the send completes
+	ByteRing ring;
+	std::vector<OutboundSegment> segments;
+};
 struct AsyncWrite {
-	std::vector<char> buf;
+	ByteRing ring;
+	// everything that's queued, in order
+	std::vector<OutboundSegment> segments;
+	// the bytes in $segments that are still to be written
+	U32 queuedByteC= 0;
+	U32 byteCap= defaultSendQueueByteCap;
+	SendQueueOverflowPolicy overflowPolicy= SendQueueOverflowPolicy::degrade;
+	// set when a supersedable message is dropped, see takeDroppedMessages
+	bool droppedMessages= false;
+	// nothing more is queued once the peer is kicked
+	bool isKicked= false;
 	std::mutex bufMutex;
-	bool willNotifyOnWritable;
+	// set while queued writes are waiting for the socket to be writable, or
+	// with the uring backend, while a send is in flight
+	bool willNotifyOnWritable= false;
+	// the send that's in flight covers this many segments from the front of the
+	// queue, which stay put until it completes
+	U32 sendingSegmentC= 0;
+	std::unique_ptr<SubmittedSend> submittedSend;
+	// set while a flush is deferred to the end of this thread's batch of reactions
+	EpollThread *flushThread= nullptr;
+	U32 flushWorkI;
 };
 
 inline void noopFdReaction(void *data, U32 events, ReactionExecutionInfo) {}
 struct AsyncSocket {
+	EpollReactor &reactor;
 	signed fd;
 	AsyncRead asyncRead{};
 	AsyncWrite asyncWrite;
@@ -35,6 +243,10 @@ struct AsyncSocket {
 		*noopFdReaction,
 		{Tag::notDeleted, nullptr}
 	});
+	// with its reaction on a particular thread, rather than the least loaded one
+	AsyncSocket(EpollReactor&, U32 reactionThreadI, signed fd, U32 events, FdReaction&&);
+	// must be destroyed by its reaction thread
+	~AsyncSocket();
 };
 
 void handleMessageStreamWritable(
@@ -42,21 +254,124 @@ void handleMessageStreamWritable(
 	ReactionExecutionInfo const execInfo
 );
 
+// messages written by the socket's own reaction thread are queued, and the
+// queue is written with one syscall once the thread's batch of reactions is done
+// other threads write straight away, unless there are messages queued ahead
+// if the queue is full, see SendQueueOverflowPolicy
 void scheduleSocketWrite(
 	AsyncSocket &socket,
 	StringView<std::size_t> const src,
-	EpollReactor &reactor
+	EpollReactor &reactor,
+	MessageDurability=MessageDurability::reliable
 );
+// writes one message made of $parts without copying them, and keeps $keepAlive until it's written
+void scheduleSharedSocketWrite(
+	AsyncSocket &socket,
+	std::initializer_list<StringView<std::size_t>> parts,
+	std::shared_ptr<void const> keepAlive,
+	EpollReactor &reactor,
+	MessageDurability=MessageDurability::reliable
+);
+// returns whether any supersedable message written to $socket was dropped
+// since the last call, so that the next one can be made not to depend on it
+bool takeDroppedMessages(AsyncSocket&);
+// moves the socket's reaction to another thread
+void migrateSocketFromThisThread(AsyncSocket&, ReactionExecutionInfo, U32 targetThreadI);
+
+// position messages can also go over UDP, where a lost datagram doesn't hold
+// up the ones after it. every datagram carries one framed message, after
+// - client->server: the token from the client's type-6 message, then a sequence number
+// - server->client: a sequence number
+// and is ignored unless its sequence number is newer than any received before
+// from the same peer, so only the newest position gets through
+// a datagram no bigger than this fits in any path's MTU
+U32 constexpr maxDatagramByteC= 1200;
+// how many datagrams are sent or received with one syscall
+U32 constexpr datagramBatchSize= 32;
+// returns whether $sequence is after $newest, allowing for sequence numbers wrapping around
+inline bool isNewerSequence(U32 const sequence, U32 const newest) {
+	return 0 < static_cast<S32>(sequence - newest);
+}
+
+struct Datagram {
+	char const *data;
+	U32 byteC;
+	sockaddr_in const *from;
+};
+
+// drops, duplicates and reorders outgoing datagrams like netem does, so that
+// the UDP channel can be tested over loopback without root. the percentages are
+// read from UDP_SHIM_LOSS, UDP_SHIM_DUPLICATE and UDP_SHIM_REORDER, and are 0 if they're unset
+struct DatagramShim {
+	U8 lossPercent;
+	U8 duplicatePercent;
+	// the chance of a datagram being held back until after the next one
+	U8 reorderPercent;
+	std::mutex mutex;
+	std::minstd_rand random;
+	std::vector<char> heldBack;
+	sockaddr_in heldBackAddr;
+	// 0 if the datagram was sent on a connected socket, without an address
+	socklen_t heldBackAddrLen;
+	bool isHoldingBack= false;
+	DatagramShim();
+};
+struct UdpSocket {
+	signed fd;
+	DatagramShim shim;
+	UdpSocket(signed fd);
+	~UdpSocket();
+};
+// sends as many of $messages as the socket takes without blocking, the rest are dropped
+// $messages' names must be sockaddr_ins, or null if the socket is connected
+void sendDatagrams(UdpSocket&, mmsghdr *messages, U32 messageC);
 
 unsigned constexpr tcpListenBacklog= 5;
 unsigned constexpr port= 9333;
 unsigned constexpr epollReceivedEventBufSize= 10;
-unsigned constexpr maxMessagesToReceiveAtOnce= 10;
 auto constexpr positionUpdateInterval= std::chrono::milliseconds{10};
-U32 const defaultSocketEvents= EPOLLIN | EPOLLRDHUP;
+// how often a client makes an input, and how long the server plays each for
+auto constexpr inputTick= positionUpdateInterval;
+// how stream sockets are registered with epoll. with the uring backend,
+// neither applies, since a send's completion takes the place of EPOLLOUT
+enum class SocketTriggering {
+	// EPOLLOUT is only registered for while queued writes are waiting for the
+	// socket, which takes an epoll_ctl whenever that starts and stops
+	level,
+	// registered for EPOLLOUT all along, which is only reported once the socket
+	// becomes writable again. reads and writes carry on until EAGAIN anyway
+	edge,
+};
+SocketTriggering constexpr socketTriggering= SocketTriggering::edge;
+U32 const defaultSocketEvents=
+	EPOLLIN | EPOLLRDHUP
+	| (reactorBackend == ReactorBackend::epoll && socketTriggering == SocketTriggering::edge
+		? U32{EPOLLOUT | EPOLLET}
+		: 0);
 
 namespace Sync {
 	typedef U32 PlayerC;
 	typedef PlayerC PlayerI;
 }
-typedef U32L MessageBufSize;
+// servers refuse connections beyond this many players, so ids at or past it
+// are never sent, and clients size their player lists by the ids they're sent
+Sync::PlayerC constexpr maxPlayerC= 1 << 12;
+// set on an id in a type-4 message to say that the player went out of range
+Sync::PlayerI constexpr outOfRangeFlag= Sync::PlayerI{1} << 31;
+
+// the positions sent in a type-5 message, which both ends keep so that later
+// messages can be encoded relative to them
+struct DeltaBaseline {
+	// 0 for an unused slot, sequence numbers start from 1
+	U32 sequence= 0;
+	// (id, position) pairs, in ascending order of id
+	std::vector<std::pair<Sync::PlayerI, UpdatePos>> positions;
+};
+// how many of the most recent baselines are kept, a type-5 message can only be
+// encoded relative to one of these
+U32 constexpr deltaBaselineC= 32;
+typedef StaticArray<DeltaBaseline, deltaBaselineC> DeltaBaselines;
+// returns null if the baseline with this sequence number was overwritten
+DeltaBaseline const *findDeltaBaseline(DeltaBaselines const&, U32 sequence);
+// clears and returns the slot that a new baseline with this sequence number goes in
+DeltaBaseline &replaceDeltaBaseline(DeltaBaselines&, U32 sequence);
@@ -1,51 +1,336 @@
-#include<fcntl.h> // fcntl, O_NONBLOCK
+#include<algorithm> // std::lower_bound, std::max, std::sort
+#include<array> // std::array
+#include<atomic> // std::atomic
+#include<cmath> // std::isfinite
+#include<cstdlib> // std::abs
+#include<random> // std::mt19937_64, std::random_device
+#include<shared_mutex> // std::shared_mutex, std::shared_lock
 #include<netinet/in.h> // sockaddr, sockaddr_in
 #include<sys/epoll.h> // epoll_create, epoll_ctl, epoll_wait, epoll_event
-#include<sys/socket.h> // socket
+#include<sys/socket.h> // socket, accept4
 #include<unistd.h> // write
+#include<unordered_map> // std::unordered_map
 #include<vector> // std::vector
 #include"common.hpp"
 #include"networking.hpp"
 #include"networking-impl.hpp"
 #include"position/cpp.hpp"
 #include"memcpy.hpp"
+#include"varint.hpp"
 
-// server->client message types
+// server->client message types, each framed as described at maxFrameHeaderByteC
 // 0: here are the ids of existing players
 // 1: a new player joined, here is their id
 // 2: a player disconnected, here is their id
 // 3: here are the positions of all players you've been told are connected
+// 4: here are the ids and positions of some of the players you've been told are connected,
+//    and of those that went out of range, whose ids are marked with outOfRangeFlag
+// 5: here are the positions of all players you've been told are connected,
+//    relative to the type-5 message you most recently acknowledged
+// 6: here is the token to start your datagrams with
+// 7: your inputs were played up to this sequence number, which left you at this position
 
-template<typename... Srcs>
-auto serialise(Srcs &&...srcs) {
-	StaticArray<char, (0 + ... + sizeof(Srcs))> ret{Tag::defaultInitialise};
-	std::size_t offset= 0;
-	(... , [&ret, &offset, &srcs]{
-		std::memcpy(getData(ret) + offset, &srcs, sizeof srcs);
-		offset += sizeof srcs;
-	}());
-	return ret;
-}
+// how each tick's positions are sent to each player
+enum class PositionEncoding {
+	// type 3: everyone's absolute position
+	all,
+	// type 4: the absolute positions of the players within the recipient's
+	// interest radius, leaving out those whose positions the recipient already has,
+	// and the last positions of those that left it, so that the recipient hides them
+	// it goes over TCP, since it relies on every message arriving
+	nearby,
+	// type 5: everyone's position relative to what the recipient last acknowledged
+	// it goes over TCP too, so only type 3 avoids head-of-line blocking
+	delta,
+};
+PositionEncoding constexpr positionEncoding= PositionEncoding::nearby;
+PositionComponent constexpr defaultInterestRadius= 48;
+// side length of the spatial index's cubic cells
+PositionComponent constexpr interestCellSize= 64;
+// what happens to a player that reads its messages slower than they're sent
+SendQueueOverflowPolicy constexpr sendQueueOverflowPolicy= SendQueueOverflowPolicy::degrade;
+U8F constexpr reactorThreadC= 4;
+// how incoming connections are accepted
+enum class AcceptMode {
+	// one listening socket, whose reaction places each connection on the least loaded thread
+	single,
+	// a listening socket for each reactor thread, so that the kernel spreads
+	// connections across the threads, and each stays on the thread that accepted it
+	sharded,
+};
+AcceptMode constexpr acceptMode= AcceptMode::sharded;
+// a power of 2. inputs that arrive while this many of a player's are waiting to be played are dropped
+U32 constexpr maxQueuedInputC= 128;
+// how much faster than real time a player's inputs can be played, so that it
+// catches up after its inputs were held up, but can't hold them back itself to
+// then move faster than inputSpeed. each input stands for an inputTick, so its
+// sequence number is its timestamp
+double constexpr maxInputPlaybackSpeed= 1.2;
+auto constexpr minInputPlaybackInterval= std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+	std::chrono::duration<double>{inputTick} / maxInputPlaybackSpeed
+);
+// a player whose inputs ran out is let this far behind, so that an input
+// arriving just after a tick isn't held up until the next one
+auto constexpr maxInputPlaybackLag= inputTick;
+
+struct QueuedInput {
+	U32 sequence;
+	PlayerInput input;
+};
 
 struct MutexedPlayers;
 struct Player{
 	AsyncSocket socket;
-	Position position;
-	Player(EpollReactor&, signed socketFd, MutexedPlayers &players, Sync::PlayerI);
+	// held while queueing and playing inputs, since they come in on two threads
+	std::mutex inputQueueMutex;
+	// these are guarded by $inputQueueMutex
+	// the sequence number of the newest input queued or dropped
+	U32 receivedInputSequence= 0;
+	// the inputs waiting to be played, oldest first from $queuedInputHead
+	std::array<QueuedInput, maxQueuedInputC> queuedInputs;
+	U32 queuedInputHead= 0;
+	U32 queuedInputC= 0;
+	// when the next queued input can be played, see maxInputPlaybackSpeed
+	std::chrono::steady_clock::time_point nextInputPlaybackTime{};
+	// only accessed from the player's socket reaction thread, which plays its inputs
+	// the sequence number of the newest input played
+	U32 playedInputSequence= 0;
+	// held while sending join/leave notices and snapshots to this player, so
+	// that a snapshot is never sent after a notice it doesn't reflect
+	std::mutex membershipMutex;
+	// the players table generation that this player has been told about
+	U32 toldGeneration;
+	// the count of type-0, 1 and 2 messages sent to this player, which its
+	// datagrams carry so that it can tell which set of players they're about
+	U32 sentMembershipNoticeC= 0;
+	// where this player's datagrams come from, once one has
+	sockaddr_in udpAddr;
+	bool hasUdpAddr= false;
+	// identifies this player's datagrams, it's told this in a type-6 message
+	U64 udpToken;
+	// the UDP sockets' reactions race to update this, so the newest one wins
+	std::atomic<U32> newestUdpSequence= 0;
+	// players further away than this aren't sent to this player
+	PositionComponent interestRadius;
+	// these are only accessed from the player's socket reaction thread
+	// the number of the last snapshot this player was sent positions from
+	U32 lastSentSnapshotNumber= 0;
+	// (id, join generation) pairs of the players that were within the interest
+	// radius when this player was last sent positions, sorted by id
+	std::vector<std::pair<Sync::PlayerI, U32>> inRangePlayers;
+	U32 nextSnapshotSequence= 1;
+	U32 acknowledgedSnapshotSequence= 0;
+	// the $playedInputSequence that this player was last sent in a type-7 message
+	U32 toldInputSequence= 0;
+	DeltaBaselines sentBaselines{Tag::defaultInitialise};
+	Player(EpollReactor&, U32 reactionThreadI, signed socketFd, MutexedPlayers &players, Sync::PlayerI);
 private:
 	// ctor implementation
 	Player(signed const socketFd, ReactionHandle const&);
 };
 
+// how the players' inputs are being played, for monitoring. they're logged
+// once per loadWindow while inputs are being dropped
+struct InputPlaybackStats {
+	// the inputs waiting in every player's queue
+	std::atomic<U32> queuedInputC{0};
+	// since the server started
+	std::atomic<U64> playedInputC{0};
+	// the inputs that arrived when their player's queue was full, since the server started
+	std::atomic<U64> droppedInputC{0};
+	// only accessed by reportInputPlayback
+	U64 reportedDroppedInputC= 0;
+};
+
+// PlayerStates has maxPlayerC slots, and connections beyond that are refused, so that it never
+// has to move, which would take a lock that the positions' writers would have to share
+// what a snapshot reads of each player, by the player's slot in the players
+// table, kept apart from the players so that a snapshot is packed in a linear
+// pass over these rather than by chasing a pointer to each player
+// each slot's position is published like a Seqlock, by the thread that owns
+// the player's socket, so that moving a player takes no lock
+struct PlayerStates {
+	// the inner values of the position's PositionComponents, stored as relaxed
+	// atomics like a Seqlock's words
+	std::unique_ptr<std::atomic<S32>[]> x, y, z;
+	// each slot's seqlock sequence number, which only changes when the slot's
+	// player moves, so it doubles as a version number
+	std::unique_ptr<std::atomic<U32>[]> sequences;
+	// the generation at which the slot's player joined, unique among players
+	// guarded by MutexedPlayers::mutex
+	std::unique_ptr<U32[]> joinGenerations;
+	PlayerStates();
+};
+PlayerStates::PlayerStates():
+	x{std::make_unique<std::atomic<S32>[]>(maxPlayerC)},
+	y{std::make_unique<std::atomic<S32>[]>(maxPlayerC)},
+	z{std::make_unique<std::atomic<S32>[]>(maxPlayerC)},
+	sequences{std::make_unique<std::atomic<U32>[]>(maxPlayerC)},
+	joinGenerations{std::make_unique<U32[]>(maxPlayerC)}
+{}
+// only one thread may publish to a given slot at a time
+static void publishPosition(PlayerStates &states, Sync::PlayerI const slotI, UpdatePos const &position) {
+	auto &sequence= states.sequences[slotI];
+	U32 const oldSequence= sequence.load(std::memory_order_relaxed);
+	// an odd sequence number tells readers that a write is in progress
+	sequence.store(oldSequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	states.x[slotI].store(position.x, std::memory_order_relaxed);
+	states.y[slotI].store(position.y, std::memory_order_relaxed);
+	states.z[slotI].store(position.z, std::memory_order_relaxed);
+	sequence.store(oldSequence + 2, std::memory_order_release);
+}
+// retries until it reads a position that no write raced with, whose sequence number is put in $sequence
+static UpdatePos loadPosition(PlayerStates const &states, Sync::PlayerI const slotI, U32 &sequence) {
+	UpdatePos ret;
+	for(;;) {
+		sequence= states.sequences[slotI].load(std::memory_order_acquire);
+		if(sequence & 1)
+			continue;
+		ret= {
+			states.x[slotI].load(std::memory_order_relaxed),
+			states.y[slotI].load(std::memory_order_relaxed),
+			states.z[slotI].load(std::memory_order_relaxed),
+		};
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if(sequence == states.sequences[slotI].load(std::memory_order_relaxed))
+			return ret;
+	}
+}
+static UpdatePos loadPosition(PlayerStates const &states, Sync::PlayerI const slotI) {
+	U32 sequence;
+	return loadPosition(states, slotI, sequence);
+}
+
 struct MutexedPlayers {
-	HoleyArray<std::unique_ptr<Player>, Sync::PlayerC> o{5};
-	// controls access to the array of players and to the players themselves
-	// should each Player have their own mutex?
+	// it's never grown, see maxPlayerC
+	BitmapHoleyArray<std::unique_ptr<Player>, Sync::PlayerC> o{maxPlayerC};
+	// controls access to the array of players. positions are published through
+	// $states instead, so that moving players doesn't take this
 	std::mutex mutex;
+	PlayerStates states;
+	// incremented whenever a player joins or leaves
+	U32 generation= 0;
+	// the players by the tokens that their datagrams start with
+	std::unordered_map<U64, Player*> udpTokens;
+	// held exclusively while $udpTokens is changed, and shared by the UDP
+	// sockets' reactions while they use the players they look up, so that a
+	// player's token is taken out before it's destroyed, without the
+	// datagrams taking $mutex or waiting on each other
+	std::shared_mutex udpTokensMutex;
+	// guarded by $mutex
+	std::mt19937_64 udpTokenRandom{std::random_device{}()};
+	InputPlaybackStats inputPlaybackStats;
 };
 
+// tells $player about the current set of players by sending it $message
+static void sendMembershipNotice(
+	Player &player,
+	MutexedPlayers const &players,
+	StringView<std::size_t> const message,
+	EpollReactor &reactor
+) {
+	std::lock_guard g{player.membershipMutex};
+	scheduleSocketWrite(player.socket, message, reactor);
+	player.toldGeneration= players.generation;
+	++player.sentMembershipNoticeC;
+}
+
+// queues the inputs in the payload of a type-2 message received from $player
+// over either of its channels, skipping those that were received already
+static void queueInputs(
+	Player &player,
+	InputPlaybackStats &stats,
+	char const *const payload,
+	U32 const payloadByteC
+) {
+	U32 newestSequence;
+	U8 inputC;
+	if(payloadByteC < sizeof newestSequence + sizeof inputC)
+		return;
+	memcpyInit(newestSequence, payload);
+	memcpyInit(inputC, payload + sizeof newestSequence);
+	char const *const inputs= payload + sizeof newestSequence + sizeof inputC;
+	if(payloadByteC < sizeof newestSequence + sizeof inputC + U32{inputC}*inputByteC)
+		return;
+	std::lock_guard g{player.inputQueueMutex};
+	U32 queuedC= 0, droppedC= 0;
+	for(U8F i=0; i<inputC; ++i) {
+		U32 const sequence= newestSequence - (inputC - 1 - i);
+		if(!isNewerSequence(sequence, player.receivedInputSequence))
+			continue;
+		player.receivedInputSequence= sequence;
+		// it's never played, and the client's prediction is corrected once a later one is
+		if(player.queuedInputC == maxQueuedInputC) {
+			++droppedC;
+			continue;
+		}
+		auto &queued= player.queuedInputs[(player.queuedInputHead + player.queuedInputC++) & (maxQueuedInputC - 1)];
+		++queuedC;
+		queued.sequence= sequence;
+		memcpyInit(queued.input.buttons, inputs + i*inputByteC);
+		memcpyInit(queued.input.yaw, inputs + i*inputByteC + sizeof queued.input.buttons);
+		// it's still played, so that the client's told it was, but standing still
+		if(!std::isfinite(queued.input.yaw))
+			queued.input= {};
+	}
+	stats.queuedInputC.fetch_add(queuedC, std::memory_order_relaxed);
+	if(droppedC)
+		stats.droppedInputC.fetch_add(droppedC, std::memory_order_relaxed);
+}
+
+// plays as many of $player's queued inputs as maxInputPlaybackSpeed allows by $now
+// must run on the player's socket reaction thread, which publishes its position
+static void playQueuedInputs(
+	Player &player,
+	Sync::PlayerI const playerI,
+	MutexedPlayers &players,
+	std::chrono::steady_clock::time_point const now
+) {
+	auto &stats= players.inputPlaybackStats;
+	std::lock_guard g{player.inputQueueMutex};
+	player.nextInputPlaybackTime= std::max(player.nextInputPlaybackTime, now - maxInputPlaybackLag);
+	auto const oldPosition= loadPosition(players.states, playerI);
+	auto position= oldPosition;
+	U32 playedC= 0;
+	for(; player.queuedInputC && player.nextInputPlaybackTime <= now; --player.queuedInputC) {
+		auto const &queued= player.queuedInputs[player.queuedInputHead++ & (maxQueuedInputC - 1)];
+		applyInput(position, queued.input);
+		player.playedInputSequence= queued.sequence;
+		player.nextInputPlaybackTime+= minInputPlaybackInterval;
+		++playedC;
+	}
+	if(!playedC)
+		return;
+	stats.queuedInputC.fetch_sub(playedC, std::memory_order_relaxed);
+	stats.playedInputC.fetch_add(playedC, std::memory_order_relaxed);
+	// the sequence number's only bumped if the player moved
+	if(position != oldPosition)
+		publishPosition(players.states, playerI, position);
+}
+
+// sends a type-7 message if more of $player's inputs were played since it was
+// last sent one, so that it can correct where it predicted it would be
+// must run on the player's socket reaction thread
+static void sendPlayedInput(
+	Player &player,
+	Sync::PlayerI const playerI,
+	PlayerStates const &states,
+	EpollReactor &reactor
+) {
+	U32 const sequence= player.playedInputSequence;
+	if(sequence == player.toldInputSequence)
+		return;
+	player.toldInputSequence= sequence;
+	scheduleSocketWrite(
+		player.socket,
+		serialiseMessage(MessageType{7}, sequence, loadPosition(states, playerI)),
+		reactor,
+		MessageDurability::supersedable
+	);
+}
+
 struct NewConnectionContext {
-	EpollReactor *reactor;
 	MutexedPlayers &players;
 	signed tcpListenSockFd;
 };
@@ -53,6 +338,8 @@ struct NewConnectionContext {
 struct PlayerSocketReactionContext {
 	MutexedPlayers &players;
 	Sync::PlayerI playerI;
+	// the player is only destroyed by its own socket reaction, so it outlives this
+	Player &player;
 };
 
 static void handlePlayerSocketReady(
@@ -61,28 +348,31 @@ static void handlePlayerSocketReady(
 	ReactionExecutionInfo const execInfo
 ) {
 	auto &ctx= assertExists(static_cast<PlayerSocketReactionContext*>(ctx_));
-	auto &player= [&ctx]()->Player& {
-		std::lock_guard g{ctx.players.mutex};
-		return assertExists(ctx.players.o[ctx.playerI].get());
-	}();
+	auto &player= ctx.player;
 	auto const &handleClientDisconnected= [&player, &ctx, execInfo]{
 		std::cout << "player " << ctx.playerI << " disconnected, closing socket...\n";
-		PERROR_ASSERT(0 == close(player.socket.fd));
 		auto &players= ctx.players;
 		auto const playerI= ctx.playerI;
+		std::lock_guard g{players.mutex};
+		PERROR_ASSERT(0 == close(player.socket.fd));
 		// remove the player from its thread's reaction table (this destroys ctx)
-		removeReactionFromThisThread(getThisThread(execInfo), player.socket.reactionHandle.epollReactionI);
-		// remove the player from the list of players
+		removeReactionFromThisThread(getThisThread(execInfo), *player.socket.reactionHandle.reaction);
+		// remove the player from the list of players, once no datagram's using it
+		{
+			std::lock_guard g{players.udpTokensMutex};
+			players.udpTokens.erase(player.udpToken);
+		}
+		players.inputPlaybackStats.queuedInputC.fetch_sub(player.queuedInputC, std::memory_order_relaxed);
 		destroy(players.o, playerI);
+		++players.generation;
 		// notify all the other players that this one has disconnected
-		std::lock_guard g{players.mutex};
 		foreach(players.o,
-			[playerI, execInfo]
+			[&players, playerI, execInfo]
 			(auto const filledI, auto const oI, std::unique_ptr<Player> const &player) {
-				auto const buf= serialise(MessageType{2}, playerI);
-				scheduleSocketWrite(
-					player.get()->socket,
-					serialise(MessageType{2}, playerI - (oI <= playerI)),
+				sendMembershipNotice(
+					*player,
+					players,
+					serialiseMessage(MessageType{2}, playerI - (oI <= playerI)),
 					execInfo.thisReactor
 				);
 			}
@@ -93,97 +383,158 @@ static void handlePlayerSocketReady(
 		handleClientDisconnected();
 		return;
 	}
+	// before reading, which can end with the player destroyed
+	if(epollEvents & EPOLLOUT)
+		handleMessageStreamWritable(player.socket, execInfo);
 	if(epollEvents & EPOLLIN) handleMessageStreamReadable(
-		player.socket.fd,
-		player.socket.asyncRead,
+		player.socket,
+		execInfo,
 		// handle message
-		[&ctx, &player]
+		[&player, &stats= ctx.players.inputPlaybackStats]
 			(MessageType messageType,
-			char const *scanPos,
-			auto remainingByteC
-		)->FastInteger<MessageBufSize> {
-			// assume the message is an UpdatePos for now
-			ASSERT(messageType == 0);
-			if(remainingByteC < sizeof(UpdatePos))
-				return -1;
-			std::lock_guard g{ctx.players.mutex};
-			memcpyInit(getX(player.position), scanPos + 0*sizeof(Position::El));
-			memcpyInit(getY(player.position), scanPos + 1*sizeof(Position::El));
-			memcpyInit(getZ(player.position), scanPos + 2*sizeof(Position::El));
-/*			std::cout
-				<< "updating position: {"
-				<< player.x << ","
-				<< player.y << ","
-				<< player.z
-				<< "}\n"; */
-			return sizeof(UpdatePos);
+			char const *payload,
+			U32 payloadByteC
+		) {
+			switch(messageType) {
+			case 1: {
+					U32 sequence;
+					if(payloadByteC < AcknowledgeSnapshotMessageLength)
+						return;
+					memcpyInit(sequence, payload);
+					// acknowledgements can't arrive out of order over a stream
+					player.acknowledgedSnapshotSequence= sequence;
+					return;
+				}
+			case 2:
+				queueInputs(player, stats, payload, payloadByteC);
+				return;
+			default:
+				// from a newer client, its frame says how much to skip
+				return;
+			}
 		},
 		// handle end of stream
 		handleClientDisconnected
 	);
-	if(epollEvents & EPOLLOUT)
-		handleMessageStreamWritable(player.socket, execInfo);
 }
 
 Player::Player(
 	EpollReactor &reactor,
+	U32 const reactionThreadI,
 	signed const socketFd,
 	MutexedPlayers &players,
 	Sync::PlayerI const playerI
 ):
 	socket{
 		reactor,
+		reactionThreadI,
 		socketFd,
 		defaultSocketEvents,
 		{
 			handlePlayerSocketReady,
 			{Tag::defaultDeleted, *new PlayerSocketReactionContext{
-				players, playerI
+				players, playerI, *this
 			}}
 		}
 	},
-	// if a player spawns somewhere other than the origin, here is where that would need to change
-	position{{0, 0, 0}}
-{}
+	// the generation at which it will be told about the existing players,
+	// no snapshot can match this before then
+	toldGeneration{players.generation + 1},
+	interestRadius{defaultInterestRadius}
+{
+	// nothing is sent to the player before it's added to the players table
+	socket.asyncWrite.overflowPolicy= sendQueueOverflowPolicy;
+}
 
-static void handleNewConnection(void *newConnCtx_, U32 const epollEvent, ReactionExecutionInfo const execInfo) {
-	auto const &ctx= assertExists(static_cast<NewConnectionContext*>(newConnCtx_));
-	sockaddr_in clientAddr_{};
-	socklen_t connectingSockAddrLen= sizeof clientAddr_;
-	auto const tcpConnSockFd= [&]{
-		for(;;) {
-			signed const acceptRet= accept(
-				ctx.tcpListenSockFd,
-				&reinterpret_cast<sockaddr&>(clientAddr_),
-				&connectingSockAddrLen
-			);
-			if(0 <= acceptRet)
-				return acceptRet;
-			PERROR_ASSERT(errno == EINTR);
-			std::cout << "accept interrupted, retrying...\n";
+// each reactor thread has a UDP socket, all bound to the same port, which
+// SO_REUSEPORT lets them share. the kernel spreads the clients across them,
+// so that their datagrams are received on every thread
+struct UdpContext {
+	MutexedPlayers &players;
+	UdpSocket &socket;
+};
+
+// claims $sequence as the newest of $player's datagrams, unless a newer one already arrived
+static bool claimUdpSequence(Player &player, U32 const sequence) {
+	U32 newest= player.newestUdpSequence.load(std::memory_order_relaxed);
+	do
+		if(!isNewerSequence(sequence, newest))
+			return false;
+	while(!player.newestUdpSequence.compare_exchange_weak(newest, sequence, std::memory_order_relaxed));
+	return true;
+}
+
+// each datagram from a client is its token, a sequence number, then a type-2 message
+static void handlePlayerDatagrams(void *const ctx_, U32 const epollEvents, ReactionExecutionInfo) {
+	auto &ctx= assertExists(static_cast<UdpContext*>(ctx_));
+	receiveDatagrams(ctx.socket.fd, [&players= ctx.players](Datagram const *const datagrams, U32 const datagramC) {
+		// so that none of the players are destroyed while their inputs are queued
+		std::shared_lock g{players.udpTokensMutex};
+		for(U32 i=0; i<datagramC; ++i) {
+			auto const &datagram= datagrams[i];
+			U64 token;
+			U32 sequence;
+			U32 constexpr headerByteC= sizeof token + sizeof sequence;
+			if(datagram.byteC < headerByteC)
+				continue;
+			memcpyInit(token, datagram.data);
+			memcpyInit(sequence, datagram.data + sizeof token);
+			auto const it= players.udpTokens.find(token);
+			if(it == end(players.udpTokens))
+				continue;
+			auto &player= *it->second;
+			Frame frame;
+			if(
+				decodeFrame(frame, datagram.data + headerByteC, datagram.byteC - headerByteC)
+					!= FrameDecodeResult::complete
+				|| frame.type != MessageType{2}
+			)
+				continue;
+			// older than one that already arrived
+			if(!claimUdpSequence(player, sequence))
+				continue;
+			queueInputs(player, players.inputPlaybackStats, frame.payload, frame.payloadByteC);
+			// the address can change if the client is behind a NAT
+			auto const &from= *datagram.from;
+			std::lock_guard g{player.membershipMutex};
+			if(
+				!player.hasUdpAddr
+				|| player.udpAddr.sin_addr.s_addr != from.sin_addr.s_addr
+				|| player.udpAddr.sin_port != from.sin_port
+			) {
+				player.udpAddr= from;
+				player.hasUdpAddr= true;
+			}
 		}
-	}();
-	U32 const clientAddr= clientAddr_.sin_addr.s_addr;
-	char clientAddrMem[sizeof clientAddr];
-	memcpyInspect(clientAddrMem, clientAddr);
-	std::cout << "accepted a connection! client addr: "
-		<< static_cast<signed>(clientAddrMem[0]) << '.'
-		<< static_cast<signed>(clientAddrMem[1]) << '.'
-		<< static_cast<signed>(clientAddrMem[2]) << '.'
-		<< static_cast<signed>(clientAddrMem[3])
-		<< '\n';
-	fcntl(tcpConnSockFd, F_SETFL, O_NONBLOCK);
-	PERROR_ASSERT(-1 != fcntl(tcpConnSockFd, F_SETFL, O_NONBLOCK));
-	std::lock_guard g{ctx.players.mutex};
+	});
+}
+
+// adds a player for the connection on $tcpConnSockFd, with its reaction on thread $reactionThreadI
+static void addPlayer(
+	MutexedPlayers &players,
+	signed const tcpConnSockFd,
+	U32 const reactionThreadI,
+	ReactionExecutionInfo const execInfo
+) {
+	std::lock_guard g{players.mutex};
+	if(size(players.o) == maxPlayerC) {
+		std::cout << "the server is full, closing the connection...\n";
+		PERROR_ASSERT(0 == close(tcpConnSockFd));
+		return;
+	}
 	auto const playerInfo= emplace(
-		ctx.players.o,
-		[&ctx, tcpConnSockFd](auto const &cons, auto const playerI_)->auto {
+		players.o,
+		[&players, tcpConnSockFd, reactionThreadI, &execInfo](auto const &cons, auto const playerI_)->auto {
 			Sync::PlayerI const playerI= playerI_;
 			WATCH(playerI);
+			// before the player's reaction can run, and move it
+			players.states.joinGenerations[playerI]= players.generation + 1;
+			publishPosition(players.states, playerI, spawnPosition);
 			auto playerPtr= std::make_unique<Player>(
-				*ctx.reactor,
+				execInfo.thisReactor,
+				reactionThreadI,
 				tcpConnSockFd,
-				ctx.players,
+				players,
 				playerI
 			);
 			auto &player= *playerPtr;
@@ -193,12 +544,13 @@ static void handleNewConnection(void *newConnCtx_, U32 const epollEvent, Reactio
 	);
 	auto &player= std::get<0>(playerInfo);
 	auto const newPlayerI= std::get<1>(playerInfo);
-	Sync::PlayerC const playerC= size(ctx.players.o) - 1; // don't include the new player
+	++players.generation;
+	Sync::PlayerC const playerC= size(players.o) - 1; // don't include the new player
 	std::cout << "preliminary send, sending playerC=" << playerC << "\n";
 
 	// gather indices of existing players, except for the current player
 	std::vector<Sync::PlayerI> playerIs;
-	foreach(ctx.players.o,
+	foreach(players.o,
 		[newPlayerI, &playerIs]
 		(auto const filledI, auto const oI, std::unique_ptr<Player>&) {
 			if(oI == newPlayerI)
@@ -208,108 +560,698 @@ static void handleNewConnection(void *newConnCtx_, U32 const epollEvent, Reactio
 	);
 
 	// send a message to the new player containing the ids of all the existing players
-	MessageType const existingPlayersMessageType= 0;
-	auto const bufSize=
-		sizeof(existingPlayersMessageType)
-		+ sizeof playerC
-		+ sizeof(Sync::PlayerI) * playerIs.size();
+	U32 const payloadByteC= sizeof playerC + sizeof(Sync::PlayerI) * playerIs.size();
+	auto const headerByteC= getFrameHeaderByteC(payloadByteC);
+	auto const bufSize= headerByteC + payloadByteC;
 	auto const mem= std::make_unique<char[]>(bufSize);
-	memcpyInspect(mem.get(), existingPlayersMessageType);
-	memcpyInspect(mem.get() + sizeof(MessageType), playerC);
-	for(U32 i=0; i<playerIs.size(); ++i)
+	writeFrameHeader(mem.get(), MessageType{0}, payloadByteC);
+	memcpyInspect(mem.get() + headerByteC, playerC);
+	for(U32 i=0; i<playerIs.size(); ++i) {
+		// relative to the new player, like the ids in every other message
+		Sync::PlayerI const relativeI= playerIs[i] - (newPlayerI < playerIs[i]);
 		memcpyInspect(
-			mem.get() + sizeof(MessageType) + sizeof playerC + i*sizeof(Sync::PlayerI),
-			playerIs[i]
+			mem.get() + headerByteC + sizeof playerC + i*sizeof(Sync::PlayerI),
+			relativeI
 		);
-	scheduleSocketWrite(player.socket, {mem.get(), bufSize}, execInfo.thisReactor);
+	}
+	sendMembershipNotice(player, players, {mem.get(), bufSize}, execInfo.thisReactor);
+	// and the token to start its datagrams with
+	{
+		std::lock_guard g{players.udpTokensMutex};
+		do
+			player.udpToken= players.udpTokenRandom();
+		while(!player.udpToken || !players.udpTokens.emplace(player.udpToken, &player).second);
+	}
+	scheduleSocketWrite(
+		player.socket,
+		serialiseMessage(MessageType{6}, player.udpToken),
+		execInfo.thisReactor
+	);
 	
 	// send a message to all existing players containing the id of the new player
 	for(auto const playerI : playerIs)
-		scheduleSocketWrite(
-			ctx.players.o[playerI]->socket,
-			serialise(MessageType{1}, newPlayerI - (playerI <= newPlayerI)),
+		sendMembershipNotice(
+			*players.o[playerI],
+			players,
+			serialiseMessage(MessageType{1}, newPlayerI - (playerI <= newPlayerI)),
 			execInfo.thisReactor
 		);
 }
 
-static void broadcastPlayerPositions(void *players_, ReactionExecutionInfo execInfo) {
-	auto &players= assertExists(static_cast<MutexedPlayers*>(players_));
-	std::cout << "broadcasting player positions...\n";
-	std::lock_guard g0{players.mutex};
-	if(size(players.o) < 1)
+static void acceptPlayer(
+	NewConnectionContext const &ctx,
+	signed const tcpConnSockFd,
+	sockaddr_in const &clientAddr_,
+	ReactionExecutionInfo const execInfo
+) {
+	U32 const clientAddr= clientAddr_.sin_addr.s_addr;
+	char clientAddrMem[sizeof clientAddr];
+	memcpyInspect(clientAddrMem, clientAddr);
+	std::cout << "accepted a connection on thread " << execInfo.thisThreadI << "! client addr: "
+		<< static_cast<signed>(clientAddrMem[0]) << '.'
+		<< static_cast<signed>(clientAddrMem[1]) << '.'
+		<< static_cast<signed>(clientAddrMem[2]) << '.'
+		<< static_cast<signed>(clientAddrMem[3])
+		<< '\n';
+	addPlayer(
+		ctx.players,
+		tcpConnSockFd,
+		acceptMode == AcceptMode::sharded
+			? execInfo.thisThreadI
+			: getLeastLoadedThreadI(execInfo.thisReactor),
+		execInfo
+	);
+}
+
+static void handleNewConnection(void *newConnCtx_, U32 const epollEvent, ReactionExecutionInfo const execInfo) {
+	auto const &ctx= assertExists(static_cast<NewConnectionContext*>(newConnCtx_));
+	// with the uring backend, the connection's already accepted, one per call
+	if constexpr(reactorBackend == ReactorBackend::uring) {
+		signed const tcpConnSockFd= takeAcceptedFd(getThisThread(execInfo));
+		if(-1 == tcpConnSockFd)
+			return;
+		sockaddr_in clientAddr_{};
+		socklen_t clientAddrLen= sizeof clientAddr_;
+		// a connection that's been reset since has no peer address, but its reaction finds that out
+		getpeername(tcpConnSockFd, &reinterpret_cast<sockaddr&>(clientAddr_), &clientAddrLen);
+		acceptPlayer(ctx, tcpConnSockFd, clientAddr_, execInfo);
 		return;
-	auto const bufSize= sizeof(MessageType) + 3*sizeof(Position::El) * (size(players.o) - 1);
-	auto const buf= std::make_unique<char[]>(bufSize);
-	memcpyInspect(buf.get(), MessageType{3});
-	foreach(players.o,
-		[&players, &execInfo, buf= buf.get(), bufSize]
-		(auto, auto const oI0, auto &player) {
-			foreach(
-				players.o,
-				[buf= buf+sizeof(MessageType), oI0, haveReachedSamePlayer= false]
-				(auto const filledI, auto const oI1, auto &player) mutable {
-					if(oI0 == oI1) {
-						// don't send a player their own position
-						haveReachedSamePlayer= true;
-						return;
-					}
-					auto const i= filledI - haveReachedSamePlayer;
-					memcpyInspect(buf + (0 + i*3)*sizeof(Position::El), getX(player->position));
-					memcpyInspect(buf + (1 + i*3)*sizeof(Position::El), getY(player->position));
-					memcpyInspect(buf + (2 + i*3)*sizeof(Position::El), getZ(player->position));
-				}
+	}
+	// several connections can be waiting, which happens when everyone
+	// reconnects at once after a restart
+	for(;;) {
+		sockaddr_in clientAddr_{};
+		socklen_t connectingSockAddrLen= sizeof clientAddr_;
+		signed const tcpConnSockFd= accept4(
+			ctx.tcpListenSockFd,
+			&reinterpret_cast<sockaddr&>(clientAddr_),
+			&connectingSockAddrLen,
+			SOCK_NONBLOCK
+		);
+		if(-1 == tcpConnSockFd) {
+			if(EAGAIN == errno || EWOULDBLOCK == errno)
+				return;
+			// ECONNABORTED is a connection that was reset while it waited to be accepted
+			PERROR_ASSERT(EINTR == errno || ECONNABORTED == errno);
+			continue;
+		}
+		acceptPlayer(ctx, tcpConnSockFd, clientAddr_, execInfo);
+	}
+}
+
+static S32 getInterestCellComponent(S32 const positionComponent) {
+	// round towards negative infinity, so that cells don't straddle the origin
+	auto const quotient= positionComponent / interestCellSize.o;
+	return quotient - (positionComponent % interestCellSize.o < 0);
+}
+// packs a cell's coordinates so that the spatial index can be sorted by it
+static U64 getInterestCellKey(S32 const x, S32 const y, S32 const z) {
+	U64 constexpr mask= (U64{1} << 21) - 1;
+	return
+		(static_cast<U64>(x) & mask) << 42
+		| (static_cast<U64>(y) & mask) << 21
+		| (static_cast<U64>(z) & mask);
+}
+
+struct PlayerVersion {
+	U32 joinGeneration;
+	// the sequence number of the player's slot in PlayerStates
+	U32 sequence;
+	// the number of the snapshot in which the player's position last changed
+	U32 changedSnapshotNumber;
+};
+
+// every player's position at one tick, shared between the broadcast shards
+struct PositionSnapshot {
+	// snapshots are numbered consecutively from 1
+	U32 number;
+	std::chrono::steady_clock::time_point time;
+	U32 generation;
+	// ascending slot indices of the players in the snapshot
+	std::vector<Sync::PlayerI> playerIs;
+	// in the same order as playerIs
+	std::vector<PlayerVersion> versions;
+	// a type-3 message containing every player's position, in the same order
+	// its header is for the message that each recipient gets, without its own position
+	std::unique_ptr<char[]> message;
+	std::size_t messageSize;
+	// where the positions start in $message
+	U32 positionsI;
+	// (cell key, index into playerIs) pairs, sorted by cell key
+	std::vector<std::pair<U64, U32>> cells;
+};
+
+static UpdatePos getPosition(PositionSnapshot const &snapshot, U32 const snapshotI) {
+	UpdatePos ret;
+	memcpyInit(ret, snapshot.message.get() + snapshot.positionsI + snapshotI*sizeof(UpdatePos));
+	return ret;
+}
+
+struct BroadcastContext {
+	MutexedPlayers &players;
+	// by reactor thread, each one sends its datagrams through its own
+	std::vector<std::unique_ptr<UdpSocket>> &udpSockets;
+	std::mutex snapshotMutex;
+	std::shared_ptr<PositionSnapshot const> snapshot;
+};
+
+// each player's position is packed into the message once per tick
+static std::shared_ptr<PositionSnapshot const> takeSnapshot(
+	MutexedPlayers &players,
+	std::chrono::steady_clock::time_point const time,
+	PositionSnapshot const *const previous
+) {
+	auto ret= std::make_shared<PositionSnapshot>();
+	ret->number= previous ? previous->number + 1 : 1;
+	ret->time= time;
+	{
+		std::lock_guard g{players.mutex};
+		auto const playerC= size(players.o);
+		ret->generation= players.generation;
+		ret->playerIs.resize(playerC);
+		ret->versions.resize(playerC);
+		U32 const recipientPayloadByteC= playerC ? sizeof(UpdatePos) * (playerC - 1) : 0;
+		ret->positionsI= getFrameHeaderByteC(recipientPayloadByteC);
+		ret->messageSize= ret->positionsI + sizeof(UpdatePos) * playerC;
+		ret->message= std::make_unique<char[]>(ret->messageSize);
+		writeFrameHeader(ret->message.get(), MessageType{3}, recipientPayloadByteC);
+		// a pass down the occupancy bitmap, reading the columns in slot order
+		// the message has each player's components together, so they're interleaved as they're copied
+		auto const &states= players.states;
+		auto const &occupancy= players.o.occupancy;
+		char *const positions= ret->message.get() + ret->positionsI;
+		U32 filledI= 0;
+		for(U32 wordI=0; wordI<occupancy.size(); ++wordI)
+			for(U64 word= occupancy[wordI]; word; word&= word - 1) {
+				Sync::PlayerI const slotI= wordI*64 + __builtin_ctzll(word);
+				auto &version= ret->versions[filledI];
+				memcpyInspect(positions + filledI*sizeof(UpdatePos), loadPosition(states, slotI, version.sequence));
+				version.joinGeneration= states.joinGenerations[slotI];
+				version.changedSnapshotNumber= ret->number;
+				ret->playerIs[filledI++]= slotI;
+			}
+	}
+	// players whose positions haven't changed since the previous snapshot keep
+	// the number of the snapshot that they last changed in
+	if(previous)
+		for(U32 i=0, previousI=0; i<ret->playerIs.size(); ++i) {
+			auto const &previousIs= previous->playerIs;
+			for(; previousI < previousIs.size() && previousIs[previousI] < ret->playerIs[i]; ++previousI);
+			if(previousI == previousIs.size() || previousIs[previousI] != ret->playerIs[i])
+				continue;
+			auto const &previousVersion= previous->versions[previousI];
+			auto &version= ret->versions[i];
+			if(
+				previousVersion.joinGeneration == version.joinGeneration
+				&& previousVersion.sequence == version.sequence
+			)
+				version.changedSnapshotNumber= previousVersion.changedSnapshotNumber;
+		}
+	if constexpr(positionEncoding == PositionEncoding::nearby) {
+		ret->cells.reserve(ret->playerIs.size());
+		for(U32 i=0; i<ret->playerIs.size(); ++i) {
+			auto const position= getPosition(*ret, i);
+			ret->cells.emplace_back(getInterestCellKey(
+				getInterestCellComponent(position.x),
+				getInterestCellComponent(position.y),
+				getInterestCellComponent(position.z)
+			), i);
+		}
+		std::sort(begin(ret->cells), end(ret->cells));
+	}
+	return ret;
+}
+
+// the first shard to run in a tick takes the snapshot that the others share
+static std::shared_ptr<PositionSnapshot const> getSnapshot(BroadcastContext &ctx) {
+	auto const now= std::chrono::steady_clock::now();
+	std::lock_guard g{ctx.snapshotMutex};
+	if(!ctx.snapshot || ctx.snapshot->time + positionUpdateInterval/2 <= now)
+		ctx.snapshot= takeSnapshot(ctx.players, now, ctx.snapshot.get());
+	return ctx.snapshot;
+}
+
+// sends the two spans of the type-3 message on either side of the recipient's
+// own slot, since a player isn't sent their own position
+// the message is shared between all recipients, so it isn't copied into each one's queue
+static void sendAllPositions(
+	Player &recipient,
+	std::shared_ptr<PositionSnapshot const> const &snapshot,
+	U32 const recipientSnapshotI,
+	EpollReactor &reactor
+) {
+	char const *const message= snapshot->message.get();
+	// the frame header and the positions of the players before this one
+	auto const headByteC= snapshot->positionsI + recipientSnapshotI*sizeof(UpdatePos);
+	auto const tailI= headByteC + sizeof(UpdatePos);
+	scheduleSharedSocketWrite(
+		recipient.socket,
+		{{message, headByteC}, {message + tailI, snapshot->messageSize - tailI}},
+		snapshot,
+		reactor,
+		MessageDurability::supersedable
+	);
+}
+
+// a type-3 message for one player, sent over UDP
+struct PositionDatagram {
+	// the snapshot's number, then the recipient's sentMembershipNoticeC
+	char header[2*sizeof(U32)];
+	iovec iovs[3];
+	sockaddr_in addr;
+};
+
+// like sendAllPositions, but over UDP, with the recipient's datagram left in
+// $datagrams to be sent with the others
+// returns false if the recipient can't be sent datagrams yet, or the message doesn't fit in one
+// $recipient.membershipMutex must be held
+static bool prepareAllPositionsDatagram(
+	Player const &recipient,
+	PositionSnapshot const &snapshot,
+	U32 const recipientSnapshotI,
+	std::vector<PositionDatagram> &datagrams
+) {
+	auto const messageByteC= snapshot.messageSize - sizeof(UpdatePos);
+	if(!recipient.hasUdpAddr || maxDatagramByteC < sizeof(PositionDatagram::header) + messageByteC)
+		return false;
+	auto &datagram= datagrams.emplace_back();
+	memcpyInspect(datagram.header, snapshot.number);
+	memcpyInspect(datagram.header + sizeof(U32), recipient.sentMembershipNoticeC);
+	char *const message= snapshot.message.get();
+	auto const headByteC= snapshot.positionsI + recipientSnapshotI*sizeof(UpdatePos);
+	auto const tailI= headByteC + sizeof(UpdatePos);
+	// iovs[0] is pointed at the header once $datagrams stops growing
+	datagram.iovs[1]= {message, headByteC};
+	datagram.iovs[2]= {message + tailI, snapshot.messageSize - tailI};
+	datagram.addr= recipient.udpAddr;
+	return true;
+}
+
+static void sendPositionDatagrams(UdpSocket &socket, std::vector<PositionDatagram> &datagrams) {
+	std::vector<mmsghdr> messages(datagrams.size());
+	for(std::size_t i=0; i<datagrams.size(); ++i) {
+		datagrams[i].iovs[0]= {datagrams[i].header, sizeof datagrams[i].header};
+		auto &header= messages[i].msg_hdr;
+		header.msg_name= &datagrams[i].addr;
+		header.msg_namelen= sizeof datagrams[i].addr;
+		header.msg_iov= datagrams[i].iovs;
+		header.msg_iovlen= std::size(datagrams[i].iovs);
+	}
+	for(std::size_t i=0; i<messages.size(); i+= datagramBatchSize)
+		sendDatagrams(
+			socket,
+			messages.data() + i,
+			std::min<std::size_t>(datagramBatchSize, messages.size() - i)
+		);
+}
+
+// sends a type-4 message with the players within the recipient's interest
+// radius that moved since the recipient was last sent positions, or that it
+// might not have been sent yet because it moved itself, and those that have
+// left the radius since then
+// $message and $inRange are scratch memory, reused between recipients
+static void sendNearbyPositions(
+	Player &recipient,
+	PositionSnapshot const &snapshot,
+	U32 const recipientSnapshotI,
+	std::vector<char> &message,
+	std::vector<std::pair<Sync::PlayerI, U32>> &inRange,
+	EpollReactor &reactor
+) {
+	auto const recipientI= snapshot.playerIs[recipientSnapshotI];
+	// a dropped message may have had positions that haven't changed since, so
+	// they're all resent, and it may have said that players went out of range,
+	// so whoever's out of range now is said to be again
+	if(takeDroppedMessages(recipient.socket)) {
+		recipient.lastSentSnapshotNumber= 0;
+		recipient.inRangePlayers.clear();
+		for(U32 snapshotI=0; snapshotI<snapshot.playerIs.size(); ++snapshotI)
+			if(snapshotI != recipientSnapshotI)
+				recipient.inRangePlayers.push_back({
+					snapshot.playerIs[snapshotI],
+					snapshot.versions[snapshotI].joinGeneration
+				});
+	}
+	auto const lastSentNumber= recipient.lastSentSnapshotNumber;
+	bool const hasRecipientMoved=
+		lastSentNumber < snapshot.versions[recipientSnapshotI].changedSnapshotNumber;
+	auto const centre= getPosition(snapshot, recipientSnapshotI);
+	S64 const radius= recipient.interestRadius.o;
+	S32 const cellRadius= recipient.interestRadius.o / interestCellSize.o + 1;
+	S32 const centreCell[] {
+		getInterestCellComponent(centre.x),
+		getInterestCellComponent(centre.y),
+		getInterestCellComponent(centre.z),
+	};
+	message.resize(maxFrameHeaderByteC + sizeof(Sync::PlayerC));
+	Sync::PlayerC playerC= 0;
+	auto const &addEntry= [&message, &playerC, &snapshot, recipientI](U32 const snapshotI, Sync::PlayerI const flags) {
+		auto const playerI= snapshot.playerIs[snapshotI];
+		Sync::PlayerI const relativeI= (playerI - (recipientI <= playerI)) | flags;
+		auto const position= getPosition(snapshot, snapshotI);
+		auto const entryI= message.size();
+		message.resize(entryI + sizeof relativeI + sizeof position);
+		memcpyInspect(message.data() + entryI, relativeI);
+		memcpyInspect(message.data() + entryI + sizeof relativeI, position);
+		++playerC;
+	};
+	inRange.clear();
+	for(S32 x= centreCell[0] - cellRadius; x <= centreCell[0] + cellRadius; ++x)
+	for(S32 y= centreCell[1] - cellRadius; y <= centreCell[1] + cellRadius; ++y)
+	for(S32 z= centreCell[2] - cellRadius; z <= centreCell[2] + cellRadius; ++z) {
+		auto const cellKey= getInterestCellKey(x, y, z);
+		for(
+			auto it= std::lower_bound(
+				begin(snapshot.cells), end(snapshot.cells),
+				std::pair<U64, U32>{cellKey, 0}
 			);
-			scheduleSocketWrite(players.o[oI0]->socket, {buf, bufSize}, execInfo.thisReactor);
+			it != end(snapshot.cells) && it->first == cellKey;
+			++it
+		) {
+			auto const snapshotI= it->second;
+			if(snapshotI == recipientSnapshotI)
+				continue;
+			auto const position= getPosition(snapshot, snapshotI);
+			S64 const dx= S64{position.x} - centre.x;
+			S64 const dy= S64{position.y} - centre.y;
+			S64 const dz= S64{position.z} - centre.z;
+			// checking each axis first keeps the squares from overflowing
+			if(radius < std::abs(dx) || radius < std::abs(dy) || radius < std::abs(dz))
+				continue;
+			if(radius*radius < dx*dx + dy*dy + dz*dz)
+				continue;
+			inRange.push_back({snapshot.playerIs[snapshotI], snapshot.versions[snapshotI].joinGeneration});
+			if(
+				!hasRecipientMoved
+				&& snapshot.versions[snapshotI].changedSnapshotNumber <= lastSentNumber
+			)
+				continue;
+			addEntry(snapshotI, 0);
+		}
+	}
+	std::sort(begin(inRange), end(inRange));
+	for(auto const &wasInRange : recipient.inRangePlayers) {
+		if(std::binary_search(begin(inRange), end(inRange), wasInRange))
+			continue;
+		auto const it= std::lower_bound(begin(snapshot.playerIs), end(snapshot.playerIs), wasInRange.first);
+		U32 const snapshotI= it - begin(snapshot.playerIs);
+		// one that left, or whose id was taken by someone who joined since, was
+		// sent a type-2 message about instead
+		if(
+			it == end(snapshot.playerIs) || *it != wasInRange.first
+			|| snapshot.versions[snapshotI].joinGeneration != wasInRange.second
+		)
+			continue;
+		addEntry(snapshotI, outOfRangeFlag);
+	}
+	std::swap(recipient.inRangePlayers, inRange);
+	recipient.lastSentSnapshotNumber= snapshot.number;
+	if(!playerC)
+		return;
+	memcpyInspect(message.data() + maxFrameHeaderByteC, playerC);
+	scheduleSocketWrite(
+		recipient.socket,
+		finishFrame(message, MessageType{4}),
+		reactor,
+		MessageDurability::supersedable
+	);
+}
+
+// sends a type-5 message, with a bitmask of which players' positions changed
+// since the latest baseline the recipient acknowledged, followed by the
+// changes as zig-zag varints
+// $message is scratch memory, reused between recipients
+static void sendPositionDeltas(
+	Player &recipient,
+	PositionSnapshot const &snapshot,
+	U32 const recipientSnapshotI,
+	std::vector<char> &message,
+	EpollReactor &reactor
+) {
+	auto const recipientI= snapshot.playerIs[recipientSnapshotI];
+	U32 const sequence= recipient.nextSnapshotSequence++;
+	auto const acknowledgedSequence= recipient.acknowledgedSnapshotSequence;
+	// the client only keeps the baselines it received most recently, so if it
+	// hasn't acknowledged any of those, positions are sent relative to 0
+	auto const *const baseline=
+		sequence - acknowledgedSequence < deltaBaselineC
+			? findDeltaBaseline(recipient.sentBaselines, acknowledgedSequence)
+			: nullptr;
+	U32 const baselineSequence= baseline ? acknowledgedSequence : 0;
+	Sync::PlayerC const playerC= snapshot.playerIs.size() - 1;
+	U32 constexpr headerByteC= maxFrameHeaderByteC + 3*sizeof(U32);
+	message.assign(headerByteC + (playerC + 7)/8, 0);
+	auto const bitmaskI= headerByteC;
+	auto &current= replaceDeltaBaseline(recipient.sentBaselines, sequence);
+	std::size_t baselineI= 0;
+	for(U32 snapshotI=0; snapshotI<snapshot.playerIs.size(); ++snapshotI) {
+		if(snapshotI == recipientSnapshotI)
+			continue;
+		auto const playerI= snapshot.playerIs[snapshotI];
+		Sync::PlayerI const relativeI= playerI - (recipientI <= playerI);
+		auto const position= getPosition(snapshot, snapshotI);
+		current.positions.emplace_back(relativeI, position);
+		// players that weren't in the baseline are encoded relative to 0
+		UpdatePos base{0, 0, 0};
+		if(baseline) {
+			auto const &basePositions= baseline->positions;
+			for(; baselineI < basePositions.size() && basePositions[baselineI].first < relativeI; ++baselineI);
+			if(baselineI < basePositions.size() && basePositions[baselineI].first == relativeI)
+				base= basePositions[baselineI].second;
+		}
+		if(position == base)
+			continue;
+		auto const filledI= snapshotI - (recipientSnapshotI < snapshotI);
+		message[bitmaskI + filledI/8]|= static_cast<char>(1 << filledI%8);
+		// differences wrap around, so that they're exact even if they overflow
+		for(auto const &[component, baseComponent] : {
+			std::pair{position.x, base.x},
+			std::pair{position.y, base.y},
+			std::pair{position.z, base.z},
+		})
+			appendVarint(message, zigZagEncode(static_cast<S32>(
+				static_cast<U32>(component) - static_cast<U32>(baseComponent)
+			)));
+	}
+	memcpyInspect(message.data() + maxFrameHeaderByteC + 0*sizeof(U32), sequence);
+	memcpyInspect(message.data() + maxFrameHeaderByteC + 1*sizeof(U32), baselineSequence);
+	memcpyInspect(message.data() + maxFrameHeaderByteC + 2*sizeof(U32), playerC);
+	scheduleSocketWrite(
+		recipient.socket,
+		finishFrame(message, MessageType{5}),
+		reactor,
+		MessageDurability::supersedable
+	);
+}
+
+// runs on every reactor thread, and sends the snapshot to the players whose
+// sockets that thread owns
+static void broadcastPlayerPositions(void *ctx_, ReactionExecutionInfo execInfo) {
+	auto &ctx= assertExists(static_cast<BroadcastContext*>(ctx_));
+	// each shard plays its players' inputs after getting the tick's snapshot,
+	// which the first shard of the tick takes, so that every shard's inputs
+	// from the previous tick are in it, and every player is equally behind,
+	// whichever order the shards' timers happen to run in
+	auto const snapshot= getSnapshot(ctx);
+	// the type-7 messages sent below then say where these inputs left each player
+	auto const now= std::chrono::steady_clock::now();
+	foreach(getThisThread(execInfo).fdReactionTable,
+		[&players= ctx.players, now]
+		(auto, auto, std::unique_ptr<FdReaction> const &reaction) {
+			if(&reaction->func.get() != &handlePlayerSocketReady)
+				return;
+			auto const &reactionCtx= *static_cast<PlayerSocketReactionContext*>(reaction->data.o);
+			playQueuedInputs(reactionCtx.player, reactionCtx.playerI, players, now);
+		}
+	);
+	auto const &playerIs= snapshot->playerIs;
+	std::vector<char> scratch;
+	std::vector<std::pair<Sync::PlayerI, U32>> inRangeScratch;
+	std::vector<PositionDatagram> datagrams;
+	foreach(getThisThread(execInfo).fdReactionTable,
+		[&execInfo, &states= ctx.players.states, &snapshot, &playerIs, &scratch, &inRangeScratch, &datagrams]
+		(auto, auto, std::unique_ptr<FdReaction> const &reaction) {
+			if(&reaction->func.get() != &handlePlayerSocketReady)
+				return;
+			auto const &reactionCtx= *static_cast<PlayerSocketReactionContext*>(reaction->data.o);
+			auto &player= reactionCtx.player;
+			sendPlayedInput(player, reactionCtx.playerI, states, execInfo.thisReactor);
+			std::lock_guard g{player.membershipMutex};
+			if(player.toldGeneration != snapshot->generation)
+				// the player has been told about a join or leave that happened
+				// after the snapshot was taken, so it will get the next one
+				return;
+			auto const it= std::lower_bound(begin(playerIs), end(playerIs), reactionCtx.playerI);
+			ASSERT(it != end(playerIs) && *it == reactionCtx.playerI);
+			U32 const snapshotI= it - begin(playerIs);
+			switch(positionEncoding) {
+			case PositionEncoding::all:
+				if(!prepareAllPositionsDatagram(player, *snapshot, snapshotI, datagrams))
+					sendAllPositions(player, snapshot, snapshotI, execInfo.thisReactor);
+				break;
+			case PositionEncoding::nearby:
+				sendNearbyPositions(player, *snapshot, snapshotI, scratch, inRangeScratch, execInfo.thisReactor);
+				break;
+			case PositionEncoding::delta:
+				sendPositionDeltas(player, *snapshot, snapshotI, scratch, execInfo.thisReactor);
+				break;
+			}
+		}
+	);
+	// $snapshot keeps the messages alive until they're sent
+	sendPositionDatagrams(*ctx.udpSockets[execInfo.thisThreadI], datagrams);
+}
+
+// a thread only gives a player to another thread if it spent at least this
+// much more of each second in reactions, so that players don't bounce between
+// threads with similar loads
+auto constexpr minRebalanceReactionTime= std::chrono::milliseconds{50};
+
+// runs on every reactor thread once per load window, and moves one player to
+// the least loaded thread if this one is busier
+// it moves the player whose socket reactions took the longest, short of ones
+// that would just make the other thread the busier of the two
+static void rebalancePlayers(void*, ReactionExecutionInfo const execInfo) {
+	auto &reactor= execInfo.thisReactor;
+	U32 const targetThreadI= getLeastLoadedThreadI(reactor);
+	if(targetThreadI == execInfo.thisThreadI)
+		return;
+	auto &thisThread= getThisThread(execInfo);
+	std::chrono::microseconds const thisLoad{
+		thisThread.load.reactionMicrosPerSecond.load(std::memory_order_relaxed)
+	};
+	std::chrono::microseconds const targetLoad{
+		reactor.reactorThreads[targetThreadI].load.reactionMicrosPerSecond.load(std::memory_order_relaxed)
+	};
+	if(thisLoad < targetLoad + minRebalanceReactionTime)
+		return;
+	// loads are per second, and reaction times are per load window
+	auto const maxMovedReactionTime= (thisLoad - targetLoad) / 2
+		* std::chrono::duration<double>{loadWindow}.count();
+	Player *movedPlayer= nullptr;
+	std::chrono::steady_clock::duration movedReactionTime{};
+	foreach(thisThread.fdReactionTable,
+		[&movedPlayer, &movedReactionTime, maxMovedReactionTime]
+		(auto, auto, std::unique_ptr<FdReaction> const &reaction) {
+			if(&reaction->func.get() != &handlePlayerSocketReady)
+				return;
+			if(reaction->recentReactionTime < movedReactionTime || maxMovedReactionTime < reaction->recentReactionTime)
+				return;
+			movedPlayer= &static_cast<PlayerSocketReactionContext*>(reaction->data.o)->player;
+			movedReactionTime= reaction->recentReactionTime;
 		}
 	);
+	if(!movedPlayer)
+		return;
+	migrateSocketFromThisThread(movedPlayer->socket, execInfo, targetThreadI);
+}
+
+// logs the input playback figures if inputs were dropped since they were last logged
+static void reportInputPlayback(void *const stats_, ReactionExecutionInfo) {
+	auto &stats= assertExists(static_cast<InputPlaybackStats*>(stats_));
+	U64 const droppedInputC= stats.droppedInputC.load(std::memory_order_relaxed);
+	if(droppedInputC == stats.reportedDroppedInputC)
+		return;
+	std::cout
+		<< "dropped " << droppedInputC - stats.reportedDroppedInputC << " inputs, "
+		<< stats.queuedInputC.load(std::memory_order_relaxed) << " are queued, "
+		<< stats.playedInputC.load(std::memory_order_relaxed) << " were played\n";
+	stats.reportedDroppedInputC= droppedInputC;
 }
 
 signed main() {
 	MutexedPlayers players;
-	// https://riptutorial.com/posix/example/16533/tcp-concurrent-echo-server
-	signed const tcpListenSockFd= socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	PERROR_ASSERT(0 <= tcpListenSockFd);
-	WATCH(tcpListenSockFd);
-	signed const shouldEnableReusePort= true;
-	setsockopt(
-		tcpListenSockFd,
-		SOL_SOCKET,
-		SO_REUSEPORT,
-		&shouldEnableReusePort,
-		sizeof shouldEnableReusePort
-	);
 	sockaddr_in addrToAcceptOn{};
 	addrToAcceptOn.sin_family= AF_INET;
 	// "The sin_port and sin_addr members shall be in network byte order" ~Posix
 	addrToAcceptOn.sin_port= htons(port);
 	addrToAcceptOn.sin_addr.s_addr= 0;
-	PERROR_ASSERT(0 == bind(
-		tcpListenSockFd,
-		&reinterpret_cast<sockaddr&>(addrToAcceptOn),
-		sizeof addrToAcceptOn
-	));
-	PERROR_ASSERT(-1 != fcntl(tcpListenSockFd, F_SETFL, O_NONBLOCK));
-	PERROR_ASSERT(0 == listen(tcpListenSockFd, tcpListenBacklog));	
-	NewConnectionContext newConnCtx{
-		getUninitialised<EpollReactor*>(),
-		players,
-		tcpListenSockFd
-	};
+	// all bound to the same port, which SO_REUSEPORT lets them share
+	std::vector<NewConnectionContext> newConnCtxs;
+	for(U8F listenerI=0; listenerI < (acceptMode == AcceptMode::sharded ? reactorThreadC : 1); ++listenerI) {
+		// https://riptutorial.com/posix/example/16533/tcp-concurrent-echo-server
+		signed const tcpListenSockFd= socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+		PERROR_ASSERT(0 <= tcpListenSockFd);
+		WATCH(tcpListenSockFd);
+		signed const shouldEnableReusePort= true;
+		PERROR_ASSERT(0 == setsockopt(
+			tcpListenSockFd,
+			SOL_SOCKET,
+			SO_REUSEPORT,
+			&shouldEnableReusePort,
+			sizeof shouldEnableReusePort
+		));
+		PERROR_ASSERT(0 == bind(
+			tcpListenSockFd,
+			&reinterpret_cast<sockaddr&>(addrToAcceptOn),
+			sizeof addrToAcceptOn
+		));
+		PERROR_ASSERT(0 == listen(tcpListenSockFd, tcpListenBacklog));
+		newConnCtxs.push_back({players, tcpListenSockFd});
+	}
+	// the UDP sockets are on the same port, one for each reactor thread
+	std::vector<std::unique_ptr<UdpSocket>> udpSockets;
+	std::vector<UdpContext> udpCtxs;
+	for(U8F threadI=0; threadI<reactorThreadC; ++threadI) {
+		signed const udpSockFd= socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+		PERROR_ASSERT(0 <= udpSockFd);
+		signed const shouldEnableReusePort= true;
+		PERROR_ASSERT(0 == setsockopt(
+			udpSockFd,
+			SOL_SOCKET,
+			SO_REUSEPORT,
+			&shouldEnableReusePort,
+			sizeof shouldEnableReusePort
+		));
+		PERROR_ASSERT(0 == bind(
+			udpSockFd,
+			&reinterpret_cast<sockaddr&>(addrToAcceptOn),
+			sizeof addrToAcceptOn
+		));
+		udpSockets.push_back(std::make_unique<UdpSocket>(udpSockFd));
+		udpCtxs.push_back({players, *udpSockets.back()});
+	}
+	BroadcastContext broadcastCtx{players, udpSockets, {}, {}};
 	// reactor must be declared after contexts, because its destructor will block
 	// on the joining of the internal thread pool
-	EpollReactor reactor{4};
-	newConnCtx.reactor= &reactor;
-	addFdReaction(
-		reactor,
-		tcpListenSockFd,
-		EPOLLIN,
-		{
+	EpollReactor reactor{reactorThreadC};
+	for(U8F listenerI=0; listenerI<newConnCtxs.size(); ++listenerI) {
+		FdReaction reaction{
 			handleNewConnection,
-			{Tag::notDeleted, &newConnCtx}
-		}
-	);
-	addTimerReaction(reactor, positionUpdateInterval, TimerReaction{
-		*broadcastPlayerPositions,
-		{Tag::notDeleted, static_cast<void*>(&players)}
+			{Tag::notDeleted, &newConnCtxs[listenerI]}
+		};
+		reaction.operation= FdOperation::accept;
+		auto const fd= newConnCtxs[listenerI].tcpListenSockFd;
+		if(acceptMode == AcceptMode::sharded)
+			addFdReaction(reactor, listenerI, fd, EPOLLIN, std::move(reaction));
+		else
+			addFdReaction(reactor, fd, EPOLLIN, std::move(reaction));
+	}
+	for(U8F threadI=0; threadI<udpCtxs.size(); ++threadI)
+		addFdReaction(
+			reactor,
+			threadI,
+			udpCtxs[threadI].socket.fd,
+			EPOLLIN,
+			{
+				handlePlayerDatagrams,
+				{Tag::notDeleted, &udpCtxs[threadI]}
+			}
+		);
+	for(U8F threadI=0; threadI<reactor.reactorThreads.size; ++threadI) {
+		addTimerReaction(reactor, threadI, positionUpdateInterval, TimerReaction{
+			*broadcastPlayerPositions,
+			{Tag::notDeleted, static_cast<void*>(&broadcastCtx)}
+		});
+		// the uring backend can't move players between threads
+		if(reactorBackend == ReactorBackend::epoll)
+			addTimerReaction(reactor, threadI, loadWindow, TimerReaction{
+				*rebalancePlayers,
+				{Tag::notDeleted, nullptr}
+			});
+	}
+	addTimerReaction(reactor, 0, loadWindow, TimerReaction{
+		*reportInputPlayback,
+		{Tag::notDeleted, static_cast<void*>(&players.inputPlaybackStats)}
 	});
 }
@@ -0,0 +1,164 @@
+#include<algorithm> // std::max, std::min
+#include<sys/mman.h> // mmap, munmap
+#include<sys/syscall.h> // __NR_io_uring_setup, __NR_io_uring_enter, __NR_io_uring_register
+#include<unistd.h> // syscall
+#include"common.hpp"
+#include"uring.hpp"
+
+// the kernel's indices are read and written with these, since it reads and writes them concurrently
+static U32 loadAcquire(U32 const *const o) {
+	return __atomic_load_n(o, __ATOMIC_ACQUIRE);
+}
+static void storeRelease(U32 *const o, U32 const value) {
+	__atomic_store_n(o, value, __ATOMIC_RELEASE);
+}
+
+static void *mapRing(signed const fd, std::size_t const byteC, U64 const offset) {
+	void *const ret= mmap(nullptr, byteC, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+	PERROR_ASSERT(MAP_FAILED != ret);
+	return ret;
+}
+
+Uring::Uring(U32 const minSqEntryC, U32 const minCqEntryC) {
+	io_uring_params params{};
+	params.flags=
+		IORING_SETUP_CQSIZE
+		// a bad entry fails on its own, rather than stopping the ones after it from being submitted
+		| IORING_SETUP_SUBMIT_ALL
+		// completions are only processed when the submitting thread waits for them, so
+		// they come in batches, and the kernel doesn't interrupt the thread for each
+		| IORING_SETUP_SINGLE_ISSUER
+		| IORING_SETUP_DEFER_TASKRUN
+		| IORING_SETUP_R_DISABLED;
+	// the kernel rounds these up to powers of 2
+	params.cq_entries= minCqEntryC;
+	fd= syscall(__NR_io_uring_setup, minSqEntryC, &params);
+	PERROR_ASSERT(-1 != fd);
+	// completions that don't fit in the queue are kept rather than lost
+	ASSERT(params.features & IORING_FEAT_NODROP);
+	ASSERT(params.features & IORING_FEAT_SINGLE_MMAP);
+	sqRingByteC= params.sq_off.array + params.sq_entries*sizeof(U32);
+	cqRingByteC= params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+	// both rings are in the one mapping
+	sqRingByteC= cqRingByteC= std::max(sqRingByteC, cqRingByteC);
+	sqRing= cqRing= mapRing(fd, sqRingByteC, IORING_OFF_SQ_RING);
+	sqes= static_cast<io_uring_sqe*>(mapRing(fd, params.sq_entries*sizeof(io_uring_sqe), IORING_OFF_SQES));
+	auto *const sqBytes= static_cast<char*>(sqRing);
+	auto *const cqBytes= static_cast<char*>(cqRing);
+	sqHead= reinterpret_cast<U32*>(sqBytes + params.sq_off.head);
+	sqTail= reinterpret_cast<U32*>(sqBytes + params.sq_off.tail);
+	sqMask= *reinterpret_cast<U32*>(sqBytes + params.sq_off.ring_mask);
+	sqEntryC= params.sq_entries;
+	cqes= reinterpret_cast<io_uring_cqe*>(cqBytes + params.cq_off.cqes);
+	cqHead= reinterpret_cast<U32*>(cqBytes + params.cq_off.head);
+	cqTail= reinterpret_cast<U32*>(cqBytes + params.cq_off.tail);
+	cqMask= *reinterpret_cast<U32*>(cqBytes + params.cq_off.ring_mask);
+	// the queue's entries are always used in order, so the indirection array maps each to itself
+	auto *const sqArray= reinterpret_cast<U32*>(sqBytes + params.sq_off.array);
+	for(U32 i=0; i<sqEntryC; ++i)
+		sqArray[i]= i;
+	localSqTail= *sqTail;
+}
+
+Uring::~Uring() {
+	PERROR_ASSERT(0 == munmap(sqes, sqEntryC*sizeof(io_uring_sqe)));
+	PERROR_ASSERT(0 == munmap(sqRing, sqRingByteC));
+	PERROR_ASSERT(0 == close(fd));
+}
+
+void enableUring(Uring &ring) {
+	PERROR_ASSERT(0 == syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_ENABLE_RINGS, nullptr, 0));
+}
+
+io_uring_sqe &getSqe(Uring &ring) {
+	if(ring.localSqTail - loadAcquire(ring.sqHead) == ring.sqEntryC)
+		submitUring(ring, 0);
+	ASSERT(ring.localSqTail - loadAcquire(ring.sqHead) < ring.sqEntryC);
+	auto &ret= ring.sqes[ring.localSqTail++ & ring.sqMask];
+	ret= {};
+	return ret;
+}
+
+void submitUring(Uring &ring, U32 const waitC) {
+	storeRelease(ring.sqTail, ring.localSqTail);
+	for(;;) {
+		U32 const submitC= ring.localSqTail - loadAcquire(ring.sqHead);
+		signed const enterRet= syscall(
+			__NR_io_uring_enter,
+			ring.fd,
+			submitC,
+			waitC,
+			waitC ? IORING_ENTER_GETEVENTS : 0,
+			nullptr,
+			0
+		);
+		// whatever was submitted before the signal stays submitted
+		if(-1 == enterRet && EINTR == errno)
+			continue;
+		// completions that overflowed the queue have to be taken before more can be submitted
+		if(-1 == enterRet && EBUSY == errno && waitC)
+			return;
+		PERROR_ASSERT(-1 != enterRet);
+		return;
+	}
+}
+
+U32 takeCompletions(Uring &ring, io_uring_cqe *const dst, U32 const maxC) {
+	U32 const head= *ring.cqHead;
+	U32 const completionC= std::min(loadAcquire(ring.cqTail) - head, maxC);
+	for(U32 i=0; i<completionC; ++i)
+		dst[i]= ring.cqes[(head + i) & ring.cqMask];
+	storeRelease(ring.cqHead, head + completionC);
+	return completionC;
+}
+
+UringBufferRing::UringBufferRing(
+	Uring &ring,
+	U16 const groupId,
+	U16 const bufferC,
+	U32 const bufferByteC
+):
+	groupId{groupId},
+	bufferC{bufferC},
+	bufferByteC{bufferByteC}
+{
+	ASSERT(0 == (bufferC & (bufferC - 1)));
+	// the entries have to be page aligned, which mmap is
+	void *const entriesMem= mmap(
+		nullptr,
+		bufferC*sizeof(io_uring_buf),
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS,
+		-1,
+		0
+	);
+	PERROR_ASSERT(MAP_FAILED != entriesMem);
+	entries= static_cast<io_uring_buf*>(entriesMem);
+	buffers= new char[std::size_t{bufferC}*bufferByteC];
+	io_uring_buf_reg registration{};
+	registration.ring_addr= reinterpret_cast<U64>(entries);
+	registration.ring_entries= bufferC;
+	registration.bgid= groupId;
+	PERROR_ASSERT(0 == syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &registration, 1));
+	for(U16 i=0; i<bufferC; ++i)
+		recycleBuffer(*this, i);
+}
+
+UringBufferRing::~UringBufferRing() {
+	delete[] buffers;
+	PERROR_ASSERT(0 == munmap(entries, bufferC*sizeof(io_uring_buf)));
+}
+
+char *getBuffer(UringBufferRing const &bufferRing, U16 const bufferI) {
+	return bufferRing.buffers + std::size_t{bufferI}*bufferRing.bufferByteC;
+}
+
+void recycleBuffer(UringBufferRing &bufferRing, U16 const bufferI) {
+	auto &entry= bufferRing.entries[bufferRing.localTail & (bufferRing.bufferC - 1)];
+	entry.addr= reinterpret_cast<U64>(getBuffer(bufferRing, bufferI));
+	entry.len= bufferRing.bufferByteC;
+	entry.bid= bufferI;
+	// the tail is where the first entry's reserved field would be
+	auto *const tail= &reinterpret_cast<io_uring_buf_ring*>(bufferRing.entries)->tail;
+	__atomic_store_n(tail, ++bufferRing.localTail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include<cstddef> // std::size_t
+#include<linux/io_uring.h> // io_uring_sqe, io_uring_cqe, io_uring_buf
+#include"common.hpp"
+
+// an io_uring, set up and entered with the raw syscalls
+// it starts disabled, so that it can be made on one thread and submitted to
+// from another, which then has to be the only one that submits to it
+struct Uring {
+	signed fd;
+	// shared with the kernel
+	io_uring_sqe *sqes;
+	U32 *sqHead;
+	U32 *sqTail;
+	U32 sqMask;
+	U32 sqEntryC;
+	io_uring_cqe *cqes;
+	U32 *cqHead;
+	U32 *cqTail;
+	U32 cqMask;
+	// entries up to here are filled in, and the kernel's tail catches up when they're submitted
+	U32 localSqTail= 0;
+	// for unmapping
+	void *sqRing;
+	std::size_t sqRingByteC;
+	void *cqRing;
+	std::size_t cqRingByteC;
+	Uring(U32 sqEntryC, U32 cqEntryC);
+	Uring(Uring const&)= delete;
+	~Uring();
+};
+// makes the calling thread the one that submits to $ring
+void enableUring(Uring&);
+// returns a zeroed entry, which goes with the next submitUring
+// if the queue is full, what's in it is submitted first
+io_uring_sqe &getSqe(Uring&);
+// submits what's queued, and waits until there are at least $waitC completions
+void submitUring(Uring&, U32 waitC);
+// copies up to $maxC completions to $dst, oldest first, and frees their places
+U32 takeCompletions(Uring&, io_uring_cqe *dst, U32 maxC);
+
+// buffers that the kernel picks one of for each receive, and that are handed
+// back once what was received into them is handled
+struct UringBufferRing {
+	U16 groupId;
+	// a power of 2
+	U16 bufferC;
+	U32 bufferByteC;
+	// shared with the kernel, its tail is overlaid on the first entry
+	io_uring_buf *entries;
+	char *buffers;
+	U16 localTail= 0;
+	UringBufferRing(Uring&, U16 groupId, U16 bufferC, U32 bufferByteC);
+	UringBufferRing(UringBufferRing const&)= delete;
+	~UringBufferRing();
+};
+char *getBuffer(UringBufferRing const&, U16 bufferI);
+// lets the kernel receive into the buffer again
+void recycleBuffer(UringBufferRing&, U16 bufferI);
@@ -0,0 +1,50 @@
+#pragma once
+#include<vector> // std::vector
+#include"common.hpp"
+
+// maps integers of small magnitude to small unsigned integers, so that negative
+// numbers also varint-encode to few bytes
+inline U32 zigZagEncode(S32 const x) {
+	return static_cast<U32>(x) << 1 ^ static_cast<U32>(x >> 31);
+}
+inline S32 zigZagDecode(U32 const x) {
+	return static_cast<S32>(x >> 1 ^ -(x & 1));
+}
+
+U8F constexpr maxVarintByteC= 10;
+// the most bytes that a value that fits in 32 bits takes
+U8F constexpr maxU32VarintByteC= 5;
+// appends $x 7 bits per byte, least significant first, with the top bit of
+// each byte set if more bytes follow
+inline void appendVarint(std::vector<char> &dst, U64 x) {
+	for(; 0x80 <= x; x >>= 7)
+		dst.push_back(static_cast<char>(x | 0x80));
+	dst.push_back(static_cast<char>(x));
+}
+// like appendVarint, but returns the count of bytes written to $dst
+inline U8F writeVarint(char *const dst, U64 x) {
+	U8F i= 0;
+	for(; 0x80 <= x; x >>= 7)
+		dst[i++]= static_cast<char>(x | 0x80);
+	dst[i++]= static_cast<char>(x);
+	return i;
+}
+// the count of bytes that $x takes
+inline U8F getVarintByteC(U64 x) {
+	U8F ret= 1;
+	for(; 0x80 <= x; x >>= 7)
+		++ret;
+	return ret;
+}
+// returns the count of bytes read, or 0 if $src ends before the varint does
+template<typename Size>
+U8F readVarint(U64 &dst, char const *const src, Size const srcByteC) {
+	dst= 0;
+	for(U8F i=0; i<maxVarintByteC && i<srcByteC; ++i) {
+		auto const byte= static_cast<unsigned char>(src[i]);
+		dst|= static_cast<U64>(byte & 0x7f) << 7*i;
+		if(!(byte & 0x80))
+			return i + 1;
+	}
+	return 0;
+}
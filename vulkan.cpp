@@ -2229,6 +2229,13 @@ static void createBackNoRealloc(
 	return;
 }
 
+template<typename El, typename Usage, typename Size>
+static void destroyBack(GrowableHostVisibleBuffer<El, Usage, Size> &buf) {
+	ASSERT(buf.size);
+	--buf.size;
+	buf[buf.size].~El();
+}
+
 template<typename El, typename Usage, typename Size>
 static void growToCapacity(
 	GrowableHostVisibleBuffer<El, Usage, Size> &buf,
@@ -2889,18 +2896,22 @@ static void recordDrawPlainModels(
 	for(PlainModel &plainModel : plainModels)
 		recordDraw(plainModel, [](auto const&){});
 	recordDraw(vw.statics.dietCokeModel, [&ns= program.networkingState, &vma= vw.statics.vmaAllocator](auto &poses) {
-		std::lock_guard g{ns.mutex};
-		WATCH(size(ns.otherPlayers));
-		for(; poses.size != size(ns.otherPlayers);)
+		auto const &otherPlayers= takeFront(ns.drawnOtherPlayers);
+		WATCH(otherPlayers.size());
+		// players leave, and all of them are forgotten when the connection is lost
+		for(; poses.size > otherPlayers.size();)
+			destroyBack(poses);
+		for(; poses.size < otherPlayers.size();)
 			createBack(poses, vma, PlainModelInstance{
 				{{0, 0, 0}},
 				{0.f, 0.f, 0.f, 0.f},
 			});
-		foreach(ns.otherPlayers, [&poses](auto const filledI, auto, auto const &player) {
-//			WATCH(filledI);
-//			std::cout << "player at (" << getX(player.position) << ", " << getY(player.position) << ", " << getZ(player.position) << ")\n";
-			poses[filledI].position= player.position;
-		});
+		// drawn between the positions received, so that they move smoothly at any frame rate
+		auto const now= std::chrono::steady_clock::now();
+		for(std::size_t playerI=0; playerI<otherPlayers.size(); ++playerI) {
+//			WATCH(playerI);
+			poses[playerI].position= getInterpolatedPosition(otherPlayers[playerI], now);
+		}
 //		WATCH(poses.size);
 	});
 }
@@ -3114,35 +3125,34 @@ static void renderFrame(Program &program, FramesSize const currentFrameI, U32 co
 	vw.statics.lastFrameEndTime= currentTime;
 }
 
-static void handleKeys(VulkanWindow &vw, U32 const frameI) {
-	auto constexpr speed = 0.03f;
-	// forward is +Y
-	auto const fwdX= -speed * std::sin(vw.statics.camera.yaw);
-	auto const fwdY= speed * std::cos(vw.statics.camera.yaw);
+// the player's moved by the networking thread, which predicts where the
+// server will put it, so this only says which keys are held
+static void handleKeys(Program &program, U32 const frameI) {
+	auto &vw= program.vulkanWindow;
+	auto &ns= program.networkingState;
 	auto const endP= end(vw.statics.justPressedKeys);
 	auto const endH= end(vw.statics.heldKeys);
 	auto const &heldKeys= vw.statics.heldKeys;
 	auto const &justPressedKeys= vw.statics.justPressedKeys;
-	if(heldKeys.find(GLFW_KEY_W) != endH) {
-		getX(vw.statics.camera.position) += fwdX;
-		getY(vw.statics.camera.position) += fwdY;
-	}
-	if(heldKeys.find(GLFW_KEY_S) != endH) {
-		getX(vw.statics.camera.position) -= fwdX;
-		getY(vw.statics.camera.position) -= fwdY;
-	}
-	if(heldKeys.find(GLFW_KEY_A) != endH) {
-		getX(vw.statics.camera.position) -= fwdY;
-		getY(vw.statics.camera.position) += fwdX;
-	}
-	if(heldKeys.find(GLFW_KEY_D) != endH) {
-		getX(vw.statics.camera.position) += fwdY;
-		getY(vw.statics.camera.position) -= fwdX;
-	}
+	PlayerInput input;
+	input.yaw= vw.statics.camera.yaw;
+	if(heldKeys.find(GLFW_KEY_W) != endH)
+		input.buttons|= inputForward;
+	if(heldKeys.find(GLFW_KEY_S) != endH)
+		input.buttons|= inputBack;
+	if(heldKeys.find(GLFW_KEY_A) != endH)
+		input.buttons|= inputLeft;
+	if(heldKeys.find(GLFW_KEY_D) != endH)
+		input.buttons|= inputRight;
 	if(heldKeys.find(GLFW_KEY_SPACE) != endH)
-		getZ(vw.statics.camera.position) += speed;
+		input.buttons|= inputUp;
 	if(heldKeys.find(GLFW_KEY_LEFT_CONTROL) != endH || heldKeys.find(GLFW_KEY_RIGHT_CONTROL) != endH)
-		getZ(vw.statics.camera.position) -= speed;
+		input.buttons|= inputDown;
+	publish(ns.heldInput, input);
+	auto const predicted= getDrawnPosition(loadConsistent(ns.predictedMotion), std::chrono::steady_clock::now());
+	getX(vw.statics.camera.position)= {Tag::fromInner, predicted.x};
+	getY(vw.statics.camera.position)= {Tag::fromInner, predicted.y};
+	getZ(vw.statics.camera.position)= {Tag::fromInner, predicted.z};
 	std::tuple<unsigned, std::reference_wrapper<PlainModel>, char const*> modelKeybinds[] {
 //		{ GLFW_KEY_E, vw.statics.dietCokeModel, "cans of diet coke" },
 //		{ GLFW_KEY_F, vw.statics.houseModel, "houses" },
@@ -3183,7 +3193,7 @@ void drawFrames(Program &program) {
 			vw.statics.houseModel,
 			vw.statics.cubeModel
 		};
-		handleKeys(vw, frameI);
+		handleKeys(program, frameI);
 		renderFrame(program, frameI, nextImageI);
 		for(PlainModel &model : models)
 			copy(